@@ -0,0 +1,706 @@
+#include <iostream>
+#include <fstream>
+#include <time.h>
+#include <string>
+#include <memory>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <random>
+
+#include <sys/mman.h>
+
+#include "fanshim_led.hpp"
+#include "fanshim_led_bus.hpp"
+#include "fanshim_time.hpp"
+#include "fanshim_sensor.hpp"
+#include "fanshim_fan.hpp"
+#include "fanshim_control.hpp"
+#include "fanshim_model.hpp"
+// clang++ fanshim_bench.cpp -O3 -std=c++17 -pthread -lstdc++fs -o fanshim_bench
+// with the libgpiod backends on real hardware: add -DFANSHIM_BENCH_GPIOD -lgpiodcxx
+#ifdef FANSHIM_BENCH_GPIOD
+#include <gpiod.hpp>
+#endif
+
+using namespace std;
+
+// keeps the optimizer from dropping the benchmarked work
+volatile uint32_t bench_sink;
+
+double now_ns()
+{
+    return double(monotonic_ns());
+}
+
+template <typename F>
+void bench(const string& name, long iters, F f)
+{
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++)
+        f(i);
+    double t1 = now_ns();
+    cout<<name<<": "<<(t1 - t0) / iters<<" ns/op"<<endl;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// color: the per-frame hsv2rgb path the driver used before the lookup table
+//////////////////////////////////////////////////////////////////////////////////////////
+
+double ref_hsv_f(int n, double hue,double s, double v)
+{
+    double k = fmod(n + hue/60.0, 6);
+    return v - v * s * max( { min( {k, 4-k, 1.0} ), 0.0 } );
+}
+
+vector<int> ref_hsv2rgb(double h, double s, double v)
+{
+    double hue = h * 360;
+    vector<int> rgb;
+    rgb.push_back(int(ref_hsv_f(5,hue, s, v)*255));
+    rgb.push_back(int(ref_hsv_f(3,hue, s, v)*255));
+    rgb.push_back(int(ref_hsv_f(1,hue, s, v)*255));
+    return rgb;
+}
+
+void bench_color(long iters)
+{
+    const int hi = 60, lo = 50;
+    led_color_table table;
+    table.build(hi * 1000, lo * 1000);
+
+    bench("color hsv2rgb", iters, [&](long i) {
+        double tmp = 45 + (i % 200) / 10.0;
+        int br = i & 31;
+        vector<int> rgb = ref_hsv2rgb(tmp2hue(tmp, hi, lo), 1, br/31.0);
+        bench_sink = led_word(br, rgb.at(0), rgb.at(1), rgb.at(2));
+    });
+
+    bench("color table", iters, [&](long i) {
+        int32_t md = 45000 + int32_t(i % 200) * 100;
+        bench_sink = table.lookup_md(md, (i & 31) * led_brightness_map::per_br);
+    });
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// led bus: frames/s, time per bit, syscalls per frame and frame time jitter of each backend
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// simulated clock/data wires: the APA102 side samples data on each rising clock edge,
+// so the frame can be decoded back and checked against what was sent
+struct sim_wire
+{
+    int clk = 0, dat = 0;
+    uint64_t bits = 0;
+    int nbits = 0;
+
+    void set(int c, int d)
+    {
+        if (c && !clk)
+        {
+            bits = (bits << 1) | uint64_t(d);
+            nbits++;
+        }
+        clk = c;
+        dat = d;
+    }
+
+    // the 32 bits after the 32 bit start frame, the end frame bit is the last one clocked in
+    uint32_t word() const { return uint32_t(bits >> 1); }
+};
+
+struct sim_line
+{
+    sim_wire* w;
+    bool is_clk;
+    void set_value(int v) const { is_clk ? w->set(v, w->dat) : w->set(w->clk, v); }
+};
+
+struct sim_bulk
+{
+    sim_wire* w;
+    void set_values(const vector<int>& v) const { w->set(v[0], v[1]); }
+};
+
+void bench_bus(const string& name, led_bus* bus, int frames, int bits_per_frame, sim_wire* wire = nullptr)
+{
+    led_color_table table;
+    table.build(60000, 50000);
+    vector<double> ns(frames);
+    bool decoded_ok = true;
+
+    unsigned long sys0 = led_syscalls;
+    double t_start = now_ns();
+    for (int i = 0; i < frames; i++)
+    {
+        // breathing-like sweep through temperatures and levels
+        uint32_t word = table.lookup_md(45000 + (i % 200) * 100, i % led_color_table::levels);
+        if (wire)
+            wire->nbits = 0;
+        double t0 = now_ns();
+        bus->write_frame(word);
+        ns[i] = now_ns() - t0;
+        if (wire && (wire->word() != word || wire->nbits != 65))
+            decoded_ok = false;
+    }
+    double total = now_ns() - t_start;
+    double syscalls = double(led_syscalls - sys0) / frames;
+
+    sort(ns.begin(), ns.end());
+    auto pct = [&](double p) { return ns[min(size_t(p * frames), ns.size() - 1)] / 1000; };
+    double mean = total / frames;
+
+    cout<<name<<": "<<1e9 / mean<<" frames/s, "<<mean / bits_per_frame<<" ns/bit, "
+        <<syscalls<<" syscalls/frame, cpu at 10 fps "<<mean * 10 / 1e7<<"%"<<endl;
+    cout<<"    frame us: min "<<pct(0)<<" p50 "<<pct(0.5)<<" p90 "<<pct(0.9)<<" p99 "<<pct(0.99)
+        <<" max "<<ns.back() / 1000<<(wire ? (decoded_ok ? ", decoded ok" : ", DECODE MISMATCH") : "")<<endl;
+}
+
+// hw: also the backends that touch the real gpio/spi hardware (pins 14/15 are reconfigured)
+void bench_led_buses(bool hw)
+{
+    const int frames = 20000;
+    const int gpio_bits = 32 + 32 + 1, spi_bits = 8 * led_frame_len;
+
+    sim_wire wire;
+    led_bus_lines<sim_line> sim_lines({&wire, true}, {&wire, false});
+    bench_bus("sim lines", &sim_lines, frames, gpio_bits, &wire);
+
+    led_bus_bulk<sim_bulk> sim_bulk_bus({&wire});
+    bench_bus("sim bulk", &sim_bulk_bus, frames, gpio_bits, &wire);
+
+    // the register stores only, against an anonymous mapping
+    void* regs = mmap(nullptr, led_bus_gpiomem::block_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (regs != MAP_FAILED)
+    {
+        led_bus_gpiomem mem(static_cast<volatile uint32_t*>(regs));
+        bench_bus("gpiomem (anonymous map)", &mem, frames, gpio_bits);
+        munmap(regs, led_bus_gpiomem::block_size);
+    }
+
+    try {
+        led_bus_spi null_sink(led_bus_spi::open_sink("/dev/null"));
+        bench_bus("spidev (/dev/null)", &null_sink, frames, spi_bits);
+    } catch (exception &e) {
+        cout<<"spidev (/dev/null): "<<e.what()<<endl;
+    }
+
+    if (!hw)
+        return;
+
+    try {
+        led_bus_gpiomem mem(led_bus_gpiomem::map());
+        bench_bus("gpiomem", &mem, frames, gpio_bits);
+    } catch (exception &e) {
+        cout<<"gpiomem: "<<e.what()<<endl;
+    }
+
+    try {
+        led_bus_spi spi(led_bus_spi::open_sink("/dev/spidev0.0"));
+        bench_bus("spidev0.0", &spi, frames / 10, spi_bits);
+    } catch (exception &e) {
+        cout<<"spidev0.0: "<<e.what()<<endl;
+    }
+
+#ifdef FANSHIM_BENCH_GPIOD
+    try {
+        gpiod::chip chip("gpiochip0", gpiod::chip::OPEN_BY_NAME);
+        gpiod::line_request lrq({"fanshim_bench", gpiod::line_request::DIRECTION_OUTPUT, 0});
+        {
+            gpiod::line clk = chip.get_line(led_clck_pin), dat = chip.get_line(led_dat_pin);
+            clk.request(lrq, 0);
+            dat.request(lrq, 0);
+            led_bus_lines<gpiod::line> lines(clk, dat);
+            bench_bus("libgpiod lines", &lines, frames / 10, gpio_bits);
+            clk.release();
+            dat.release();
+        }
+        gpiod::line_bulk bulk = chip.get_lines({led_clck_pin, led_dat_pin});
+        bulk.request(lrq, {0, 0});
+        led_bus_bulk<gpiod::line_bulk> bulk_bus(bulk);
+        bench_bus("libgpiod bulk", &bulk_bus, frames / 10, gpio_bits);
+        bulk.release();
+    } catch (exception &e) {
+        cout<<"libgpiod: "<<e.what()<<endl;
+    }
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// sensor: the iostream read the driver used before vs the pread() reader
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// read() syscalls of this process so far, from task io accounting
+long read_syscalls()
+{
+    ifstream io("/proc/self/io");
+    string key;
+    long v;
+    while (io >> key >> v)
+        if (key == "syscr:")
+            return v;
+    return -1;
+}
+
+template <typename F>
+void bench_sensor_read(const string& name, long iters, F f)
+{
+    long sys0 = read_syscalls();
+    bench(name, iters, f);
+    long sys1 = read_syscalls();
+    if (sys0 >= 0)
+        cout<<"    "<<double(sys1 - sys0 - 1) / iters<<" read syscalls/sample"<<endl;
+}
+
+void bench_sensor(long iters)
+{
+    // the real zone when there is one, a stand-in file otherwise
+    string path = "/sys/class/thermal/thermal_zone0/temp";
+    if (access(path.c_str(), R_OK) != 0)
+    {
+        path = "/tmp/fanshim_bench_temp";
+        ofstream(path) << "45123\n";
+    }
+    cout<<"sensor: "<<path<<endl;
+
+    fstream tmp_file(path, ios_base::in);
+    float tmp = 0;
+    bench_sensor_read("sensor iostream", iters, [&](long) {
+        tmp_file >> tmp;
+        tmp_file.seekg(0, tmp_file.beg);
+        bench_sink = uint32_t(tmp);
+    });
+
+    sysfs_temp_reader reader(path);
+    int32_t md = 0;
+    bench_sensor_read("sensor pread", iters, [&](long) {
+        reader.read(md);
+        bench_sink = uint32_t(md);
+    });
+
+    // cpu load feed-forward: the parser alone, then a full sample (pread + parse)
+    const char stat_line[] = "cpu  4705 356 584 3699 23 23 0 0 0 0\ncpu0 1393 118 290 913 5 5 0 0 0 0\n";
+    cpu_times ct;
+    bench("proc/stat parse", iters, [&](long) {
+        parse_proc_stat(stat_line, sizeof(stat_line) - 1, ct);
+        bench_sink = uint32_t(ct.total());
+    });
+
+    cpu_load_reader load("/proc", true);
+    int32_t pm = 0;
+    bench_sensor_read("proc/stat sample", iters, [&](long) {
+        load.read_load(pm);
+        bench_sink = uint32_t(pm);
+    });
+    if (load.has_pressure())
+        bench_sensor_read("pressure/cpu sample", iters, [&](long) {
+            load.read_pressure(pm);
+            bench_sink = uint32_t(pm);
+        });
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// fan: edge timing of the software pwm thread against its absolute deadlines
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct sim_fan_line
+{
+    vector<pair<int64_t, int>>* edges;
+    void set_value(int v) const { edges->push_back({monotonic_ns(), v}); }
+};
+
+void bench_fan_pwm(int freq_hz, int permille, int seconds)
+{
+    vector<pair<int64_t, int>> edges;
+    edges.reserve(size_t(freq_hz) * seconds * 2 + 16);
+    fan_pwm_soft<sim_fan_line> pwm({&edges}, freq_hz);
+    pwm.start();
+    pwm.set_duty(permille, 0);
+    sleep_until_ns(monotonic_ns() + seconds * 1000000000L);
+    pwm.stop();
+
+    // on time error per pulse and period error between rising edges, us
+    const double on_us = 1e6 / freq_hz * permille / 1000, period_us = 1e6 / freq_hz;
+    vector<double> on_err, period_err;
+    int64_t last_rise = -1;
+    for (size_t i = 0; i + 1 < edges.size(); i++)
+    {
+        if (edges[i].second != 1)
+            continue;
+        if (edges[i + 1].second == 0)
+            on_err.push_back(fabs((edges[i + 1].first - edges[i].first) / 1e3 - on_us));
+        if (last_rise >= 0)
+            period_err.push_back(fabs((edges[i].first - last_rise) / 1e3 - period_us));
+        last_rise = edges[i].first;
+    }
+    if (on_err.empty() || period_err.empty())
+        return;
+    sort(on_err.begin(), on_err.end());
+    sort(period_err.begin(), period_err.end());
+    auto pct = [](const vector<double>& v, double p) { return v[min(size_t(p * v.size()), v.size() - 1)]; };
+    cout<<"fan soft pwm "<<freq_hz<<" Hz, "<<permille / 10.0<<"%: "<<on_err.size()<<" pulses, "<<pwm.overruns()<<" overruns"<<endl;
+    cout<<"    on time error us: p50 "<<pct(on_err, 0.5)<<" p99 "<<pct(on_err, 0.99)<<" max "<<on_err.back()
+        <<"; period error us: p50 "<<pct(period_err, 0.5)<<" p99 "<<pct(period_err, 0.99)<<" max "<<period_err.back()<<endl;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// pid: relay auto-tune and closed loop against the simulated thermal plant, on a virtual clock
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_pid(int dt_ms)
+{
+    thermal_model plant;
+    const int32_t setpoint = 55000;
+    double md = plant.steady_md(0.5, 0);
+    int64_t t = 0;
+    int duty = 0;
+
+    relay_autotune tuner(setpoint, 500, 0, 1000);
+    while (!tuner.done() && !tuner.failed() && t < 4 * 3600 * 1000L)
+    {
+        duty = tuner.update(t, int32_t(md));
+        md = plant.step(md, 0.5, duty / 1000.0, dt_ms / 1000.0);
+        t += dt_ms;
+    }
+    if (!tuner.done())
+    {
+        cout<<"pid autotune ("<<dt_ms<<" ms steps): no limit cycle"<<endl;
+        return;
+    }
+    pid_gains g = tuner.gains();
+    cout<<"pid autotune ("<<dt_ms<<" ms steps): "<<t / 1000<<" s, tu "<<tuner.tu_s()<<" s, amplitude "<<tuner.amplitude()
+        <<", ku "<<tuner.ku() / 10<<" => kp "<<g.kp / 10<<" %/deg, ti "<<g.ti<<" s, td "<<g.td<<" s"<<endl;
+
+    // load steps 0.5 -> 0.9 -> 0.3 every half hour, sensor quantised to 0.1 degree
+    pid_controller pid(g);
+    pid.reset(duty);
+    double peak = 0, sq = 0;
+    long n = 0;
+    double t0 = now_ns();
+    for (int64_t k = 0; k * dt_ms < 3 * 3600 * 1000L; k++)
+    {
+        double load = k * dt_ms < 1800 * 1000L ? 0.5 : (k * dt_ms / (1800 * 1000L)) % 2 ? 0.9 : 0.3;
+        int32_t sensed = int32_t(md) / 100 * 100;
+        duty = pid.update(t, setpoint, sensed);
+        md = plant.step(md, load, duty / 1000.0, dt_ms / 1000.0);
+        t += dt_ms;
+        if (k * dt_ms > 600 * 1000L)
+        {
+            peak = max(peak, fabs(md - setpoint) / 1000);
+            sq += (md - setpoint) * (md - setpoint) / 1e6;
+            n++;
+        }
+    }
+    double ns = now_ns() - t0;
+    cout<<"    closed loop with load steps: rms error "<<sqrt(sq / max(n, 1L))<<" deg, peak "<<peak<<" deg, "
+        <<ns / (3 * 3600 * 1000L / dt_ms)<<" ns/step (pid + plant)"<<endl;
+}
+
+// a day at 10 s checks, 0.1 degree sensor, load alternating between idle and bursts of full load;
+// times the schedule search alone, per check
+void bench_mpc(const vector<int>& levels, int horizon)
+{
+    thermal_model plant;
+    const int32_t limit = 60000;
+    const int64_t dt_ms = 10000;
+    mpc_controller mpc(plant, levels, horizon, dt_ms, limit, mpc_weights());
+    double md = plant.steady_md(0.1, 0), peak = 0, total = 0;
+    vector<double> ticks;
+    int duty = 0, starts = 0;
+    long above = 0, nodes = 0, nodes_max = 0, n = 0;
+
+    for (int64_t t = 0; t < 24 * 3600 * 1000L; t += dt_ms, n++)
+    {
+        double load = (t / 60000) % 17 < 4 ? 1.0 : 0.1;
+        int32_t sensed = int32_t(md) / 100 * 100;
+        double t0 = now_ns();
+        int next = mpc.update(sensed, load, duty);
+        double ns = now_ns() - t0;
+        total += ns;
+        ticks.push_back(ns);
+        nodes += mpc.evaluated();
+        nodes_max = max(nodes_max, long(mpc.evaluated()));
+        starts += next > 0 && duty == 0;
+        duty = next;
+        md = plant.step(md, load, duty / 1000.0, dt_ms / 1000.0);
+        peak = max(peak, md);
+        above += md > limit;
+    }
+    long tree = 0;
+    for (long k = 1, w = 1; k <= horizon; k++)
+        tree += w *= levels.size();
+    sort(ticks.begin(), ticks.end());
+    cout<<"mpc "<<levels.size()<<" levels x "<<horizon<<" steps: "<<total / n / 1000<<" us/check (p99 "<<ticks[ticks.size() * 99 / 100] / 1000
+        <<"), "<<nodes / n<<" steps evaluated (max "<<nodes_max<<" of "<<tree<<"), "<<total / nodes<<" ns/step"<<endl;
+    cout<<"    closed loop: peak "<<peak / 1000<<" deg, "<<above * dt_ms / 1000<<" s above "<<limit / 1000<<", "<<starts<<" fan starts"<<endl;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// check: correctness against the code each optimization replaced, non-zero exit on a mismatch
+//////////////////////////////////////////////////////////////////////////////////////////
+
+int check_failed = 0;
+
+void expect(bool ok, const string& what)
+{
+    if (!ok)
+    {
+        cout<<"FAIL: "<<what<<endl;
+        check_failed++;
+    }
+}
+
+// temp_window against the deque + all_of it replaced, over random walks across both thresholds
+void check_temp_window()
+{
+    const int32_t on = 60000, off = 50000;
+    mt19937 rng(1);
+    uniform_int_distribution<int32_t> step(-1500, 1500), start(40000, 70000);
+    long n = 0;
+    for (int budget = 1; budget <= 16; budget++)
+    {
+        for (int walk = 0; walk < 20; walk++)
+        {
+            deque<int> tmp_q(budget, 0);
+            temp_window win(budget, on, off);
+            int32_t t = start(rng);
+            for (int i = 0; i < 2000; i++, n++)
+            {
+                t = min(max(t + step(rng), 35000), 75000);
+                tmp_q.push_back(t);
+                tmp_q.pop_front();
+                win.push(t);
+                bool all_low = all_of(tmp_q.begin(), tmp_q.end(), [=](int tx){return tx<off;});
+                bool all_high = all_of(tmp_q.begin(), tmp_q.end(), [=](int tx){return tx>on;});
+                bool same = all_low == win.all_low() && all_high == win.all_high();
+                for (int j = 0; j < budget; j++)
+                    same = same && tmp_q[j] == win.at(j);
+                if (!same)
+                {
+                    expect(false, "temp_window budget " + to_string(budget) + " sample " + to_string(i));
+                    break;
+                }
+            }
+        }
+    }
+    cout<<"temp_window: "<<n<<" samples compared"<<endl;
+}
+
+// led_bus_spi into a temp file: the bytes on the wire are led_frame_bytes, frame after frame
+void check_led_spi()
+{
+    char path[] = "/tmp/fanshim_check_spi.XXXXXX";
+    int tfd = mkstemp(path);
+    if (tfd < 0)
+    {
+        expect(false, string("mkstemp: ") + strerror(errno));
+        return;
+    }
+    close(tfd);
+
+    const uint32_t words[] = {0xe0000000, 0xff0000ff, 0xe700ff00, 0xf1ff0000, 0xffffffff};
+    const int n = sizeof(words) / sizeof(words[0]);
+    unsigned long errors = 0;
+    {
+        led_bus_spi sink(led_bus_spi::open_sink(path));
+        for (uint32_t w : words)
+            sink.write_frame(w);
+        errors = sink.write_errors;
+    }
+    ifstream f(path, ios::binary);
+    string got((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    unlink(path);
+
+    string want;
+    uint8_t buf[led_frame_len];
+    for (uint32_t w : words)
+    {
+        led_frame_bytes(w, buf);
+        want.append(reinterpret_cast<char*>(buf), led_frame_len);
+    }
+    // start frame, brightness and b g r, end frame
+    const uint8_t first[led_frame_len] = {0, 0, 0, 0, 0xe0, 0, 0, 0, 0xff};
+    expect(errors == 0, "spi sink write errors");
+    expect(got.size() == size_t(n * led_frame_len), "spi sink wrote " + to_string(got.size()) + " bytes");
+    expect(got == want, "spi sink bytes differ from led_frame_bytes");
+    expect(memcmp(want.data(), first, led_frame_len) == 0, "led_frame_bytes layout");
+    cout<<"spidev (file sink): "<<got.size()<<" bytes compared"<<endl;
+}
+
+// a throwaway directory tree standing in for /sys
+struct fake_tree
+{
+    string root;
+
+    fake_tree()
+    {
+        char tmpl[] = "/tmp/fanshim_check_sys.XXXXXX";
+        if (!mkdtemp(tmpl))
+            throw runtime_error(string("mkdtemp: ") + strerror(errno));
+        root = tmpl;
+    }
+    ~fake_tree()
+    {
+        error_code ec;
+        filesystem::remove_all(root, ec);
+    }
+
+    // creates the parent directories as needed
+    void put(const string& rel, const string& text)
+    {
+        filesystem::path p = filesystem::path(root) / rel;
+        filesystem::create_directories(p.parent_path());
+        ofstream(p) << text;
+    }
+
+    string line(const string& rel)
+    {
+        ifstream f(filesystem::path(root) / rel);
+        string l;
+        getline(f, l);
+        return l;
+    }
+};
+
+// discover() against a fake /sys: thermal zones and hwmon inputs found, everything else left out
+void check_sensor_discovery()
+{
+    fake_tree sys;
+    sys.put("class/thermal/thermal_zone0/temp", "45000\n");
+    sys.put("class/thermal/thermal_zone0/type", "cpu-thermal\n");
+    sys.put("class/thermal/thermal_zone1/temp", "52000\n");
+    sys.put("class/thermal/cooling_device0/cur_state", "0\n");
+    sys.put("class/hwmon/hwmon0/name", "rp1_adc\n");
+    sys.put("class/hwmon/hwmon0/temp1_input", "38500\n");
+    sys.put("class/hwmon/hwmon0/temp1_max", "85000\n");
+    sys.put("class/hwmon/hwmon0/in0_input", "3300\n");
+
+    temp_sensor_set s;
+    s.discover(sys.root);
+    string ids, names;
+    for (auto& src : s.sources)
+    {
+        ids += src.id + " ";
+        names += src.name + " ";
+    }
+    expect(ids == "hwmon0/temp1_input thermal_zone0 thermal_zone1 ", "discovered " + ids);
+    expect(names == "rp1_adc/temp1 cpu-thermal thermal_zone1 ", "named " + names);
+
+    int32_t md = 0;
+    expect(s.read(md) == 0 && md == 52000, "max policy read " + to_string(md));
+    s.policy = temp_policy::mean;
+    expect(s.read(md) == 0 && md == 45166, "mean policy read " + to_string(md));
+
+    temp_sensor_set none;
+    none.discover(sys.root + "/missing");
+    expect(none.sources.empty(), "sources found under a missing root");
+    cout<<"sensor discovery: "<<s.sources.size()<<" sources"<<endl;
+}
+
+// one source through garbage, a backoff, a stuck value, the file vanishing and coming back;
+// retry_ms is cleared instead of waiting out the backoff
+void check_sensor_health()
+{
+    fake_tree sys;
+    const string rel = "class/thermal/thermal_zone0/temp";
+    sys.put(rel, "50000\n");
+    temp_sensor_set s;
+    s.add(sys.root + "/" + rel);
+    s.limits.stuck_ms = 1;
+    temp_source& src = s.sources[0];
+    sensor_health& h = src.health;
+    int32_t md = 0;
+
+    expect(s.read(md) == 0 && md == 50000, "first read " + to_string(md));
+
+    sys.put(rel, "garbage\n");
+    expect(s.read(md) == -EINVAL && h.errors == 1, "garbage read");
+    expect(h.backoff_ms == sensor_health_limits::backoff_min_ms, "backoff after an error " + to_string(h.backoff_ms));
+    expect(s.read(md) == -EAGAIN && h.reads == 2, "read while backing off");
+
+    sys.put(rel, "51000\n");
+    h.retry_ms = 0;
+    expect(s.read(md) == 0 && md == 51000 && h.reopens == 1 && h.backoff_ms == 0, "recovered after the backoff");
+
+    usleep(5000);
+    expect(s.read(md) == -ESTALE && h.stuck, "same value past stuck_ms");
+
+    unlink((sys.root + "/" + rel).c_str());
+    h.retry_ms = 0;
+    expect(s.read(md) == -ENOENT && h.errors == 2, "vanished source");
+    expect(h.backoff_ms == 2 * sensor_health_limits::backoff_min_ms, "backoff doubled " + to_string(h.backoff_ms));
+
+    s.limits.stale_ms = 1;
+    usleep(5000);
+    expect(s.stale(monotonic_us() / 1000), "stale without a good reading");
+
+    sys.put(rel, "47000\n");
+    h.retry_ms = 0;
+    expect(s.read(md) == 0 && md == 47000 && !h.stuck && h.reopens == 3, "source came back");
+    expect(!s.stale(monotonic_us() / 1000), "stale after a good reading");
+    cout<<"sensor health: "<<h.reads<<" reads, "<<h.errors<<" errors, "<<h.reopens<<" reopens"<<endl;
+}
+
+// fan_pwm_sysfs against a stand-in pwmchip tree, and a chip that is not there
+void check_fan_pwm_sysfs()
+{
+    fake_tree sys;
+    sys.put("pwmchip0/export", "");
+    sys.put("pwmchip0/pwm0/period", "");
+    sys.put("pwmchip0/pwm0/duty_cycle", "");
+    sys.put("pwmchip0/pwm0/enable", "0\n");
+    {
+        fan_pwm_sysfs pwm(sys.root, 0, 0, 50);
+        expect(sys.line("pwmchip0/pwm0/period") == "20000000", "period " + sys.line("pwmchip0/pwm0/period"));
+        expect(sys.line("pwmchip0/pwm0/enable") == "1", "enable " + sys.line("pwmchip0/pwm0/enable"));
+        expect(sys.line("pwmchip0/pwm0/duty_cycle") == "0", "duty at start " + sys.line("pwmchip0/pwm0/duty_cycle"));
+        pwm.set_duty(300, 0);
+        expect(sys.line("pwmchip0/pwm0/duty_cycle") == "6000000", "duty 30% " + sys.line("pwmchip0/pwm0/duty_cycle"));
+        pwm.set_duty(1000, 0);
+        expect(sys.line("pwmchip0/pwm0/duty_cycle") == "20000000", "duty 100% " + sys.line("pwmchip0/pwm0/duty_cycle"));
+        expect(pwm.write_errors == 0, "pwm write errors");
+    }
+    expect(sys.line("pwmchip0/export").empty(), "exported a channel that was there");
+
+    bool threw = false;
+    try {
+        fan_pwm_sysfs missing(sys.root, 1, 0, 50);
+    } catch (exception &e) {
+        threw = true;
+    }
+    expect(threw, "missing pwmchip1 accepted");
+    cout<<"sysfs pwm (stand-in tree): ok"<<endl;
+}
+
+// ./fanshim_bench [hw | check]
+int main(int argc, char** argv)
+{
+    bool hw = argc > 1 && string(argv[1]) == "hw";
+    if (argc > 1 && string(argv[1]) == "check")
+    {
+        try {
+            check_temp_window();
+            check_led_spi();
+            check_sensor_discovery();
+            check_sensor_health();
+            check_fan_pwm_sysfs();
+        } catch (exception &e) {
+            expect(false, e.what());
+        }
+        cout<<(check_failed ? "check failed" : "check passed")<<endl;
+        return check_failed ? 1 : 0;
+    }
+
+    bench_color(10000000);
+    bench_led_buses(hw);
+    bench_sensor(200000);
+    bench_fan_pwm(50, 300, 2);
+    bench_pid(2000);
+    bench_pid(10000);
+    bench_mpc({0, 1000}, 6);
+    bench_mpc({0, 300, 650, 1000}, 6);
+    bench_mpc({0, 1000}, 12);
+    return 0;
+}
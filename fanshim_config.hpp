@@ -0,0 +1,302 @@
+#ifndef FANSHIM_CONFIG_HPP
+#define FANSHIM_CONFIG_HPP
+
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include "json.hpp"
+#include "fanshim_fan.hpp"
+#include "fanshim_logic.hpp"
+#include "fanshim_model.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// fanshim.json and the thermal model file, shared by the daemon and the tools
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// fs_extra receives the structured (object/array) entries of the config file
+inline std::map<std::string, int> get_fs_conf(nlohmann::json& fs_extra, const std::string& path = "/usr/local/etc/fanshim.json")
+{
+    std::map<std::string, int> fs_conf_default {
+        {"on-threshold", 60},
+        {"off-threshold", 50},
+        {"on-threshold-md", 60000},
+        {"off-threshold-md", 50000},
+        {"budget",3},
+        {"delay", 10},
+        {"brightness",0},
+        {"blink", 0},
+        {"breath_brgt",10},
+        {"led_bus", 0},
+        {"spi_bus", 0},
+        {"spi_cs", 0},
+        {"led_refresh", 30},
+        {"led_fps", 10},
+        {"adaptive", 0},
+        {"delay_min", 2},
+        {"delay_max", 30},
+        {"predict", 0},
+        {"predict_horizon", 30},
+        {"predict_window", 6},
+        {"predict_order", 1},
+        {"load_on", 0},
+        {"psi_on", 0},
+        {"load_budget", 3},
+        {"history", 60480},
+        {"history_sync", 300},
+        {"failsafe", 1}
+    };
+
+    std::map<std::string, int> fs_conf = fs_conf_default;
+
+    try
+    {
+        std::ifstream fs_cfg_file(path);
+        nlohmann::json fs_cfg_custom;
+        fs_cfg_file >> fs_cfg_custom;
+
+        for (auto& el : fs_cfg_custom.items()) {
+            if (el.value().is_structured())
+                fs_extra[el.key()] = el.value();
+            else
+                fs_conf[el.key()] = el.value();
+            // thresholds may be fractional (59.5): kept in millidegrees too
+            if ((el.key() == "on-threshold" || el.key() == "off-threshold") && el.value().is_number())
+                fs_conf[el.key() + "-md"] = int(lround(el.value().get<double>() * 1000));
+        }
+
+        if ( (fs_conf["on-threshold-md"] <= fs_conf["off-threshold-md"])
+            || (fs_conf["budget"] <= 0) || (fs_conf["delay"] <= 0)
+            || (fs_conf["breath_brgt"]<=0) || (fs_conf["breath_brgt"]>31)
+            || fs_conf["blink"]<0 || fs_conf["blink"]>3
+            || fs_conf["led_bus"]<0 || fs_conf["led_bus"]>3
+            || fs_conf["led_refresh"]<0
+            || fs_conf["led_fps"]<1 || fs_conf["led_fps"]>100
+            || fs_conf["delay_min"]<1 || fs_conf["delay_max"]<fs_conf["delay_min"]
+            || fs_conf["predict_horizon"]<=0 || fs_conf["predict_window"]<3
+            || fs_conf["predict_order"]<1 || fs_conf["predict_order"]>2
+            || fs_conf["load_on"]<0 || fs_conf["load_on"]>100 || fs_conf["psi_on"]<0 || fs_conf["psi_on"]>100
+            || fs_conf["load_budget"]<=0
+            || fs_conf["history"]<0 || fs_conf["history_sync"]<0
+            || fs_conf["failsafe"]<0 || fs_conf["failsafe"]>2 )
+        {
+            throw std::runtime_error("sanity check");
+        }
+
+    }
+    catch (std::exception &e)
+    {
+        std::cout<<"error parsing config file: "<<e.what()<<std::endl;
+        fs_conf = fs_conf_default;
+        fs_extra = nlohmann::json::object();
+    }
+
+    for (std::map<std::string,int>::iterator it=fs_conf.begin(); it!=fs_conf.end(); ++it)
+        std::cout << it->first << " => " << it->second << std::endl;
+
+    return fs_conf;
+}
+
+// "pwm": {"mode": "soft" | "sysfs", "freq": 50, "root": "/sys/class/pwm", "chip": 0, "channel": 0,
+//         "min_duty": 30, "kick_ms": 500, "curve": [{"t": 50, "duty": 30}, {"t": 70, "duty": 100}]}
+struct fan_pwm_conf
+{
+    int mode = 0;       // 0: on/off switch, 1: software pwm, 2: sysfs pwm
+    int freq = 50;
+    std::string root = "/sys/class/pwm";
+    int chip = 0, channel = 0;
+    int kick_ms = 500;
+};
+
+inline fan_pwm_conf parse_fan_pwm(const nlohmann::json& fs_extra, fan_curve& curve)
+{
+    const std::map<std::string, int> modes {
+        {"soft", 1},
+        {"sysfs", 2}
+    };
+    fan_pwm_conf conf;
+    if (!fs_extra.contains("pwm"))
+        return conf;
+
+    try {
+        const nlohmann::json& j = fs_extra["pwm"];
+        std::string mode = j.value("mode", "soft");
+        if (modes.count(mode) == 0)
+            throw std::runtime_error("unknown mode " + mode);
+        conf.freq = j.value("freq", mode == "soft" ? 50 : 25000);
+        conf.root = j.value("root", conf.root);
+        conf.chip = j.value("chip", 0);
+        conf.channel = j.value("channel", 0);
+        conf.kick_ms = j.value("kick_ms", 500);
+        curve.min_permille = int(lround(j.value("min_duty", 30.0) * 10));
+        curve.points.clear();
+        for (auto& p : j.value("curve", nlohmann::json::array({ {{"t", 50}, {"duty", 30}}, {{"t", 70}, {"duty", 100}} })))
+            curve.points.push_back({ int32_t(lround(p.at("t").get<double>() * 1000)), int(lround(p.at("duty").get<double>() * 10)) });
+        for (size_t i = 0; i < curve.points.size(); i++)
+            if (curve.points[i].permille < 0 || curve.points[i].permille > 1000 || (i > 0 && curve.points[i].md <= curve.points[i - 1].md))
+                throw std::runtime_error("curve: duty 0..100, t strictly increasing");
+        if (conf.freq < 1 || (mode == "soft" && conf.freq > 1000) || conf.kick_ms < 0
+            || curve.min_permille < 0 || curve.min_permille > 1000)
+            throw std::runtime_error("freq, kick_ms or min_duty out of range");
+        conf.mode = modes.at(mode);
+    } catch (std::exception &e) {
+        std::cout<<"error parsing pwm: "<<e.what()<<", fan on/off only"<<std::endl;
+        curve = fan_curve();
+        conf = fan_pwm_conf();
+    }
+    return conf;
+}
+
+// "pid": {"setpoint": 55, "kp": 300, "ti": 120, "td": 10, "d_div": 8,
+//         "autotune": true, "relay_low": 0, "relay_high": 100, "hyst": 0.5, "cycles": 3}
+// gains: kp in duty percent per degree, ti/td in seconds; without kp the gains are auto-tuned at startup
+inline fan_pid_conf parse_fan_pid(const nlohmann::json& fs_extra)
+{
+    fan_pid_conf conf;
+    if (!fs_extra.contains("pid"))
+        return conf;
+
+    try {
+        const nlohmann::json& j = fs_extra["pid"];
+        conf.setpoint_md = int32_t(lround(j.at("setpoint").get<double>() * 1000));
+        // percent per degree in the config, permille per degree inside
+        conf.gains.kp = j.value("kp", 0.0) * 10;
+        conf.gains.ti = j.value("ti", 0.0);
+        conf.gains.td = j.value("td", 0.0);
+        conf.d_div = j.value("d_div", 8.0);
+        conf.autotune = j.value("autotune", conf.gains.kp <= 0);
+        conf.relay_low = int(lround(j.value("relay_low", 0.0) * 10));
+        conf.relay_high = int(lround(j.value("relay_high", 100.0) * 10));
+        conf.hyst_md = int32_t(lround(j.value("hyst", 0.5) * 1000));
+        conf.cycles = j.value("cycles", 3);
+        if (conf.gains.kp < 0 || conf.gains.ti < 0 || conf.gains.td < 0 || conf.d_div <= 0
+            || (!conf.autotune && conf.gains.kp == 0))
+            throw std::runtime_error("kp > 0 (or autotune), ti, td >= 0, d_div > 0");
+        if (conf.relay_low < 0 || conf.relay_high > 1000 || conf.relay_low >= conf.relay_high
+            || conf.hyst_md < 0 || conf.cycles < 1)
+            throw std::runtime_error("relay_low < relay_high in 0..100, hyst >= 0, cycles >= 1");
+        conf.on = true;
+    } catch (std::exception &e) {
+        std::cout<<"error parsing pid: "<<e.what()<<", using the thresholds"<<std::endl;
+        conf = fan_pid_conf();
+    }
+    return conf;
+}
+
+// "mpc": {"horizon": 6, "levels": [0, 30, 65, 100], "peak": 10, "above": 10, "switch": 2, "duty": 3}
+// levels in duty percent (default 0 and 100, with pwm also min_duty and half way up), weights per horizon
+inline fan_mpc_conf parse_fan_mpc(const nlohmann::json& fs_extra, int pwm_mode, const fan_curve& curve)
+{
+    fan_mpc_conf conf;
+    if (!fs_extra.contains("mpc"))
+        return conf;
+
+    try {
+        const nlohmann::json& j = fs_extra["mpc"];
+        conf.horizon = j.value("horizon", 6);
+        if (j.contains("levels"))
+            for (auto& l : j["levels"])
+                conf.levels.push_back(int(lround(l.get<double>() * 10)));
+        else if (pwm_mode == 0)
+            conf.levels = {0, 1000};
+        else
+            conf.levels = {0, curve.min_permille, (curve.min_permille + 1000) / 2, 1000};
+        conf.weights.peak = j.value("peak", conf.weights.peak);
+        conf.weights.above = j.value("above", conf.weights.above);
+        conf.weights.switches = j.value("switch", conf.weights.switches);
+        conf.weights.duty = j.value("duty", conf.weights.duty);
+
+        if (conf.horizon < 1 || conf.horizon > mpc_controller::max_horizon)
+            throw std::runtime_error("horizon 1.." + std::to_string(mpc_controller::max_horizon));
+        if (conf.levels.size() < 2 || conf.levels.size() > size_t(mpc_controller::max_levels) || conf.levels[0] != 0)
+            throw std::runtime_error("levels: 0 and up to " + std::to_string(mpc_controller::max_levels - 1) + " duties");
+        for (size_t i = 1; i < conf.levels.size(); i++)
+            if (conf.levels[i] <= conf.levels[i - 1] || conf.levels[i] > 1000 || conf.levels[i] < curve.min_permille
+                || (pwm_mode == 0 && conf.levels[i] != 1000))
+                throw std::runtime_error("levels increasing, min_duty..100 (only 100 without pwm)");
+        // bounds the search to 5460 model steps a check even if nothing is cut (see fanshim_bench)
+        if (std::pow(double(conf.levels.size()), conf.horizon) > 4096)
+            throw std::runtime_error("levels ^ horizon over 4096 schedules");
+        if (conf.weights.peak < 0 || conf.weights.above < 0 || conf.weights.switches < 0 || conf.weights.duty < 0)
+            throw std::runtime_error("weights >= 0");
+        conf.on = true;
+    } catch (std::exception &e) {
+        std::cout<<"error parsing mpc: "<<e.what()<<", using the thresholds"<<std::endl;
+        conf = fan_mpc_conf();
+    }
+    return conf;
+}
+
+// everything the fan decision needs; pid is dropped without a pwm output (mode 0) or with mpc;
+// mpc plans with the default model until the caller sets the node's one
+inline fan_logic_conf get_fan_logic_conf(std::map<std::string, int>& fs_conf, const nlohmann::json& fs_extra, int pwm_mode, const fan_curve& curve)
+{
+    fan_logic_conf c;
+    c.on_md = fs_conf["on-threshold-md"];
+    c.off_md = fs_conf["off-threshold-md"];
+    c.budget = fs_conf["budget"];
+    c.delay_ms = fs_conf["delay"] * 1000L;
+    c.adaptive = fs_conf["adaptive"] != 0;
+    c.predict = fs_conf["predict"] != 0;
+    c.predict_window = fs_conf["predict_window"];
+    c.predict_order = fs_conf["predict_order"];
+    c.predict_horizon_ms = fs_conf["predict_horizon"] * 1000L;
+    c.load_on = fs_conf["load_on"];
+    c.psi_on = fs_conf["psi_on"];
+    c.load_budget = fs_conf["load_budget"];
+    c.failsafe = fs_conf["failsafe"];
+    c.curve = curve;
+    c.pid = parse_fan_pid(fs_extra);
+    if (c.pid.on && pwm_mode == 0)
+    {
+        std::cout<<"pid needs a pwm fan output, using the thresholds"<<std::endl;
+        c.pid.on = false;
+    }
+    c.mpc = parse_fan_mpc(fs_extra, pwm_mode, curve);
+    if (c.mpc.on && c.pid.on)
+    {
+        std::cout<<"pid and mpc both set, using mpc"<<std::endl;
+        c.pid.on = false;
+    }
+    return c;
+}
+
+// the node's thermal model as fitted by fanshim_fit, temperatures in Celsius, times in seconds:
+// {"ambient": 29.8, "tau_off": 231.5, "tau_on": 77.2, "idle_rise": 17.9, "load_rise": 31.5, ...}
+// throws if the file cannot be read or does not hold a usable model
+inline thermal_model read_thermal_model(const std::string& path)
+{
+    std::ifstream f(path);
+    if (!f)
+        throw std::runtime_error("cannot open " + path);
+    nlohmann::json j;
+    f >> j;
+    thermal_model m;
+    m.ambient_md = j.at("ambient").get<double>() * 1000;
+    m.tau_off_s = j.at("tau_off").get<double>();
+    m.tau_on_s = j.at("tau_on").get<double>();
+    m.idle_rise_md = j.at("idle_rise").get<double>() * 1000;
+    m.load_rise_md = j.at("load_rise").get<double>() * 1000;
+    if (!m.valid())
+        throw std::runtime_error("not a usable model: " + path);
+    return m;
+}
+
+// extra: anything else worth keeping with the model (fit quality, sample count)
+inline void write_thermal_model(const std::string& path, const thermal_model& m, nlohmann::json extra = nlohmann::json::object())
+{
+    extra["ambient"] = m.ambient_md / 1000;
+    extra["tau_off"] = m.tau_off_s;
+    extra["tau_on"] = m.tau_on_s;
+    extra["idle_rise"] = m.idle_rise_md / 1000;
+    extra["load_rise"] = m.load_rise_md / 1000;
+    std::ofstream f(path);
+    f << extra.dump(4) << std::endl;
+    if (!f)
+        throw std::runtime_error("cannot write " + path);
+}
+
+#endif
@@ -0,0 +1,457 @@
+#ifndef FANSHIM_CONTROL_HPP
+#define FANSHIM_CONTROL_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <memory>
+#include <string>
+
+#include "fanshim_time.hpp"
+
+// v / 10^decimals as a decimal string, without going through floating point:
+// fixed_str(45123, 3) == "45.123", fixed_str(-5, 1) == "-0.5"
+inline std::string fixed_str(int64_t v, int decimals)
+{
+    std::string s = std::to_string(v < 0 ? -uint64_t(v) : uint64_t(v));
+    if (decimals > 0)
+    {
+        if (int(s.size()) <= decimals)
+            s.insert(0, size_t(decimals + 1 - s.size()), '0');
+        s.insert(s.size() - decimals, 1, '.');
+    }
+    return v < 0 ? "-" + s : s;
+}
+
+// The last `capacity` temperatures in a fixed ring, with running counts of the ones above on / below off:
+// all_high()/all_low() are O(1) and push() never allocates, however large the budget.
+// Same decisions as all_of over a deque of the last budget samples, starting filled with `fill`.
+class temp_window
+{
+public:
+    temp_window(int capacity, int32_t on, int32_t off, int32_t fill = 0)
+        : cap(capacity), on(on), off(off), buf(new int32_t[capacity])
+    {
+        for (int i = 0; i < cap; i++)
+            buf[i] = fill;
+        high = fill > on ? cap : 0;
+        low = fill < off ? cap : 0;
+    }
+
+    void push(int32_t t)
+    {
+        int32_t old = buf[head];
+        high -= old > on;
+        low -= old < off;
+        buf[head] = t;
+        high += t > on;
+        low += t < off;
+        head = head + 1 == cap ? 0 : head + 1;
+    }
+
+    bool all_high() const { return high == cap; }
+    bool all_low() const { return low == cap; }
+
+    int size() const { return cap; }
+    // oldest first
+    int32_t at(int i) const { return buf[(head + i) % cap]; }
+
+private:
+    const int cap;
+    const int32_t on, off;
+    std::unique_ptr<int32_t[]> buf;
+    int head = 0;
+    int high, low;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// adaptive sampling: short intervals near the thresholds or when the temperature moves fast,
+// long ones when it is far from both and steady
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class adaptive_schedule
+{
+public:
+    // all times in ms, temperatures in millidegrees
+    adaptive_schedule(int64_t min_ms, int64_t max_ms, int32_t on_md, int32_t off_md)
+        : min_ms(min_ms), max_ms(max_ms), on_md(on_md), off_md(off_md) {}
+
+    // the sample just taken at t_ms => how long to sleep before the next one
+    int64_t next(int64_t t_ms, int32_t md)
+    {
+        if (last_t >= 0 && t_ms > last_t)
+        {
+            // millidegrees per second, smoothed over the last few samples
+            int64_t s = int64_t(md - last_md) * 1000 / (t_ms - last_t);
+            slope = (3 * slope + s) / 4;
+        }
+        last_t = t_ms;
+        last_md = md;
+
+        // distance to the nearest threshold, scaled onto min..max over one threshold span
+        int64_t span = std::max<int64_t>(on_md - off_md, 1);
+        int64_t dist = std::min(std::abs(int64_t(md) - on_md), std::abs(int64_t(md) - off_md));
+        int64_t interval = min_ms + (max_ms - min_ms) * std::min(dist, span) / span;
+
+        // heading for a threshold: wake at least twice before it is reached
+        if (slope > 0 && md < on_md)
+            interval = std::min(interval, (on_md - md) * 1000 / slope / 2);
+        else if (slope < 0 && md > off_md)
+            interval = std::min(interval, (md - off_md) * 1000 / -slope / 2);
+
+        // moving fast anywhere: no more than half a threshold span between samples
+        if (slope != 0)
+            interval = std::min(interval, span * 1000 / std::abs(slope) / 2);
+
+        return std::max(min_ms, std::min(max_ms, interval));
+    }
+
+    int64_t slope_md_per_s() const { return slope; }
+
+private:
+    const int64_t min_ms, max_ms;
+    const int32_t on_md, off_md;
+    int64_t last_t = -1, slope = 0;
+    int32_t last_md = 0;
+};
+
+// budget in time instead of samples, for variable intervals: the temperature has to stay above
+// (below) the threshold for window_ms, the span that budget samples at the nominal delay cover
+class timed_hysteresis
+{
+public:
+    explicit timed_hysteresis(int64_t window_ms) : window_ms(window_ms) {}
+
+    void add(int64_t t_ms, bool high, bool low)
+    {
+        high_since = high ? (high_since < 0 ? t_ms : high_since) : -1;
+        low_since = low ? (low_since < 0 ? t_ms : low_since) : -1;
+        last_t = t_ms;
+    }
+
+    bool all_high() const { return high_since >= 0 && last_t - high_since >= window_ms; }
+    bool all_low() const { return low_since >= 0 && last_t - low_since >= window_ms; }
+
+private:
+    const int64_t window_ms;
+    int64_t high_since = -1, low_since = -1, last_t = 0;
+};
+
+// wakeups per hour and how long the fan took to react once the temperature went over the threshold
+struct loop_metrics
+{
+    int64_t start_ms = -1;
+    unsigned long wakeups = 0;
+    int64_t last_cool_ms = -1;      // last sample at or below the on threshold
+    int64_t reaction_ms = 0;        // last fan-on reaction, upper bound: from that sample to the switch
+
+    void sample(int64_t t_ms, bool over_on)
+    {
+        if (start_ms < 0)
+            start_ms = t_ms;
+        wakeups++;
+        if (!over_on)
+            last_cool_ms = t_ms;
+    }
+
+    void fan_switched_on(int64_t t_ms)
+    {
+        if (last_cool_ms >= 0)
+            reaction_ms = t_ms - last_cool_ms;
+    }
+
+    // over the whole run so far, in wakeups * 1000 per hour to stay in integers
+    int64_t wakeups_per_hour_x1000(int64_t t_ms) const
+    {
+        int64_t up = std::max<int64_t>(t_ms - start_ms, 1);
+        return int64_t(wakeups) * 3600 * 1000 * 1000 / up;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// trend prediction: least squares line/parabola through the last few samples, extrapolated
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class trend_predictor
+{
+public:
+    static constexpr int max_window = 32;
+
+    // window: samples in the fit (order + 1 .. max_window); order: 1 linear, 2 quadratic
+    trend_predictor(int window, int order, int64_t horizon_ms)
+        : window(std::min(std::max(window, order + 1), max_window)), order(order), horizon_ms(horizon_ms) {}
+
+    // adds a sample, scores the predictions that came due and returns the temperature projected
+    // horizon_ms ahead (millidegrees); false while there are not enough samples. peak_md() is the
+    // highest the fit gets within the horizon, which a parabola can reach before its end
+    bool add(int64_t t_ms, int32_t md, int32_t& projected)
+    {
+        ts[head] = t_ms;
+        vs[head] = md;
+        head = (head + 1) % max_window;
+        count = std::min(count + 1, window);
+
+        while (n_due > 0 && due_t[due_head] <= t_ms)
+        {
+            int64_t err = std::abs(int64_t(md) - due_v[due_head]);
+            mae_md = scored == 0 ? err : (7 * mae_md + err) / 8;
+            scored++;
+            due_head = (due_head + 1) % max_window;
+            n_due--;
+        }
+
+        if (count < order + 1)
+            return false;
+
+        double c[3];
+        if (!fit(c))
+            return false;
+        double h = horizon_ms / 1000.0;
+        double at_h = c[0] + c[1] * h + c[2] * h * h, top = std::max(c[0], at_h);
+        if (c[2] < 0)
+        {
+            double tv = -c[1] / (2 * c[2]);
+            if (tv > 0 && tv < h)
+                top = std::max(top, c[0] + c[1] * tv + c[2] * tv * tv);
+        }
+        projected = int32_t(std::lround(at_h));
+        peak = int32_t(std::lround(top));
+        rising = top > c[0];
+
+        if (n_due < max_window)
+        {
+            int i = (due_head + n_due) % max_window;
+            due_t[i] = t_ms + horizon_ms;
+            due_v[i] = projected;
+            n_due++;
+        }
+        return true;
+    }
+
+    // the fit goes above the latest sample's fitted value somewhere within the horizon
+    bool is_rising() const { return rising; }
+    int32_t peak_md() const { return peak; }
+    // mean absolute error of the predictions scored so far (recent ones weigh more), millidegrees
+    int64_t error_md() const { return mae_md; }
+    unsigned long predictions_scored() const { return scored; }
+
+private:
+    const int window, order;
+    const int64_t horizon_ms;
+    int64_t ts[max_window];
+    int32_t vs[max_window];
+    int head = 0, count = 0;
+    bool rising = false;
+    int32_t peak = 0;
+
+    int64_t due_t[max_window];
+    int32_t due_v[max_window];
+    int due_head = 0, n_due = 0;
+    int64_t mae_md = 0;
+    unsigned long scored = 0;
+
+    // y = c0 + c1 t + c2 t^2, t in seconds relative to the latest sample
+    bool fit(double c[3]) const
+    {
+        double s[5] = {0, 0, 0, 0, 0}, r[3] = {0, 0, 0};
+        int last = (head + max_window - 1) % max_window;
+        for (int k = 0; k < count; k++)
+        {
+            int i = (head + max_window - 1 - k) % max_window;
+            double t = (ts[i] - ts[last]) / 1000.0, y = vs[i], p = 1;
+            for (int e = 0; e < 5; e++, p *= t)
+            {
+                s[e] += p;
+                if (e < 3)
+                    r[e] += p * y;
+            }
+        }
+
+        c[2] = 0;
+        if (order < 2)
+        {
+            double det = s[0] * s[2] - s[1] * s[1];
+            if (det == 0)
+                return false;
+            c[0] = (r[0] * s[2] - r[1] * s[1]) / det;
+            c[1] = (s[0] * r[1] - s[1] * r[0]) / det;
+            return true;
+        }
+
+        // normal equations, Cramer's rule
+        auto det3 = [](double a, double b, double cc, double d, double e, double f, double g, double h, double i) {
+            return a * (e * i - f * h) - b * (d * i - f * g) + cc * (d * h - e * g);
+        };
+        double det = det3(s[0], s[1], s[2], s[1], s[2], s[3], s[2], s[3], s[4]);
+        if (det == 0)
+            return false;
+        c[0] = det3(r[0], s[1], s[2], r[1], s[2], s[3], r[2], s[3], s[4]) / det;
+        c[1] = det3(s[0], r[0], s[2], s[1], r[1], s[3], s[2], r[2], s[4]) / det;
+        c[2] = det3(s[0], s[1], r[0], s[1], s[2], r[1], s[2], s[3], r[2]) / det;
+        return true;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// PID: fan duty (permille) holding the temperature at a setpoint
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// kp: permille per degree over the setpoint; ti, td: integral and derivative times in seconds (0: off)
+struct pid_gains
+{
+    double kp = 0, ti = 0, td = 0;
+};
+
+// Reverse acting (hotter => more duty). The derivative acts on the measurement, not the error, so
+// setpoint changes do not kick, and goes through a first-order low-pass of td / d_div seconds
+// against sensor noise. Anti-windup: the integral is frozen while the output is saturated in
+// the direction the error pushes it.
+class pid_controller
+{
+public:
+    pid_controller(const pid_gains& g, double d_div = 8, int out_min = 0, int out_max = 1000)
+        : g(g), d_div(d_div), out_min(out_min), out_max(out_max) {}
+
+    int update(int64_t t_ms, int32_t setpoint_md, int32_t md)
+    {
+        double e = (md - setpoint_md) / 1000.0;
+        double dt = last_t >= 0 ? (t_ms - last_t) / 1000.0 : 0;
+
+        if (dt > 0 && g.td > 0)
+        {
+            double raw = (md - last_md) / 1000.0 / dt;
+            double tf = g.td / d_div;
+            deriv += (raw - deriv) * dt / (tf + dt);
+        }
+        last_t = t_ms;
+        last_md = md;
+
+        double p = g.kp * e, d = g.kp * g.td * deriv;
+        double i_next = integral;
+        if (dt > 0 && g.ti > 0)
+            i_next += g.kp / g.ti * e * dt;
+
+        double u = p + i_next + d;
+        bool wind_up = (u > out_max && e > 0) || (u < out_min && e < 0);
+        if (!wind_up)
+            integral = i_next;
+        u = p + integral + d;
+        out = int(std::lround(std::min(std::max(u, double(out_min)), double(out_max))));
+        return out;
+    }
+
+    // bumpless start from a known output, e.g. the duty the fan is running at
+    void reset(int output)
+    {
+        integral = output;
+        deriv = 0;
+        last_t = -1;
+    }
+
+    int output() const { return out; }
+    const pid_gains& gains() const { return g; }
+
+private:
+    const pid_gains g;
+    const double d_div;
+    const int out_min, out_max;
+    double integral = 0, deriv = 0;
+    int64_t last_t = -1;
+    int32_t last_md = 0;
+    int out = 0;
+};
+
+// Relay feedback auto-tune (Astrom-Hagglund): the fan is switched between low and high duty as the
+// temperature crosses setpoint -/+ hyst, which settles into a limit cycle. Its period is the
+// ultimate period tu and its amplitude a gives the ultimate gain ku = 4 d / (pi sqrt(a^2 - hyst^2))
+// (d: half the relay step); the gains follow Tyreus-Luyben, less overshoot than Ziegler-Nichols
+// and better suited to a slow thermal plant.
+class relay_autotune
+{
+public:
+    relay_autotune(int32_t setpoint_md, int32_t hyst_md, int low, int high, int cycles = 3, int64_t timeout_ms = 3600000)
+        : sp(setpoint_md), hyst(hyst_md), low(low), high(high), cycles(cycles), timeout_ms(timeout_ms) {}
+
+    // duty for the next interval; done() / failed() once finished
+    int update(int64_t t_ms, int32_t md)
+    {
+        if (start_t < 0)
+        {
+            start_t = t_ms;
+            relay_high = md > sp;
+            hi_md = lo_md = md;
+        }
+        if (finished)
+            return relay_high ? high : low;
+
+        hi_md = std::max(hi_md, md);
+        lo_md = std::min(lo_md, md);
+
+        if (!relay_high && md > sp + hyst)
+        {
+            relay_high = true;
+            // one full cycle from rising switch to rising switch
+            if (last_rise >= 0)
+            {
+                // the first cycle still carries the start-up transient
+                if (++seen > 1)
+                {
+                    period_sum += (t_ms - last_rise) / 1000.0;
+                    amp_sum += (hi_md - lo_md) / 2000.0;
+                    measured++;
+                }
+                hi_md = lo_md = md;
+            }
+            last_rise = t_ms;
+        }
+        else if (relay_high && md < sp - hyst)
+            relay_high = false;
+
+        if (measured >= cycles)
+            finish(true);
+        else if (t_ms - start_t > timeout_ms)
+            finish(false);
+        return relay_high ? high : low;
+    }
+
+    bool done() const { return finished && ok; }
+    bool failed() const { return finished && !ok; }
+
+    double tu_s() const { return measured ? period_sum / measured : 0; }
+    double amplitude() const { return measured ? amp_sum / measured : 0; }     // degrees
+    double ku() const
+    {
+        double a = amplitude(), h = hyst / 1000.0;
+        double eff = std::sqrt(std::max(a * a - h * h, 1e-6));
+        return 4 * ((high - low) / 2.0) / (M_PI * eff);
+    }
+
+    pid_gains gains() const
+    {
+        pid_gains g;
+        g.kp = ku() / 2.2;
+        g.ti = 2.2 * tu_s();
+        g.td = tu_s() / 6.3;
+        return g;
+    }
+
+private:
+    const int32_t sp, hyst;
+    const int low, high, cycles;
+    const int64_t timeout_ms;
+    int64_t start_t = -1, last_rise = -1;
+    bool relay_high = false, finished = false, ok = false;
+    int32_t hi_md = 0, lo_md = 0;
+    int seen = 0, measured = 0;
+    double period_sum = 0, amp_sum = 0;
+
+    void finish(bool success)
+    {
+        finished = true;
+        ok = success;
+    }
+};
+
+#endif
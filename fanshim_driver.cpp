@@ -3,8 +3,9 @@
 // #include <unistd.h>
 #include <time.h>
 #include <string>
-#include <deque>
 #include <csignal>
+#include <atomic>
+#include <thread>
 
 #include <algorithm>
 #include <cmath>
@@ -12,25 +13,33 @@
 
 #include <filesystem>
 
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <cstring>
+
 #include "json.hpp"
+#include "fanshim_led.hpp"
+#include "fanshim_led_bus.hpp"
+#include "fanshim_time.hpp"
+#include "fanshim_sensor.hpp"
+#include "fanshim_control.hpp"
+#include "fanshim_history.hpp"
+#include "fanshim_fan.hpp"
+#include "fanshim_logic.hpp"
+#include "fanshim_config.hpp"
 #include <gpiod.hpp>
-// clang++ fanshim_driver.cpp -O3 -std=c++17 -lstdc++fs -lgpiodcxx -o out_binary
+// clang++ fanshim_driver.cpp -O3 -std=c++17 -pthread -lstdc++fs -lgpiodcxx -o out_binary
 
 using json = nlohmann::json;
 using namespace std;
 
-const int led_clck_pin = 14;
-const int led_dat_pin = 15;
 const int led_write_wait =  5;
 const int fanshim_pin = 18;
 
-const int LOW = 0;
-const int HIGH =1;
-
-int br_counter = 0;
-
 gpiod::chip rchip;
-gpiod::line ln_fan, ln_led_clk, ln_led_dat;
+gpiod::line ln_fan;
+fan_output* fan_out = nullptr;
 
 //only for <1 sec
 int nano_usleep_frac(long msec)
@@ -42,200 +51,418 @@ int nano_usleep_frac(long msec)
 }
 
 
-// hue: using 0 to 1/3 => red to green.
-double tmp2hue(double tmp, double hi, double lo)
+led_bus* led_out = nullptr;
+
+// remembers the last frame actually sent so identical frames cause no bus traffic;
+// a frame is still re-sent every refresh_sec seconds in case the LED glitched (0: never cache)
+struct led_frame_cache
 {
-    double hue = 0;
-    if (tmp < lo)
-        return 1.0/3.0;
-    else if (tmp > hi)
-        return 0.0;
-    else
-        return (hi-tmp)/(hi-lo)/3.0;
-}
+    int refresh_sec = 30;
+    atomic<unsigned long> sent{0}, suppressed{0};
+    uint32_t last = 0;
+    bool valid = false;
+    int64_t last_ms = 0;
+
+    bool fresh(uint32_t word)
+    {
+        int64_t now_ms = monotonic_ms();
+        if (valid && word == last && refresh_sec > 0 && now_ms - last_ms < refresh_sec * 1000L)
+        {
+            suppressed++;
+            return false;
+        }
+        last = word;
+        last_ms = now_ms;
+        valid = true;
+        sent++;
+        return true;
+    }
+};
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-////https://en.wikipedia.org/wiki/HSL_and_HSV#HSV_to_RGB
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+led_frame_cache led_cache;
 
-double hsv_k(int n, double hue)
+led_color_table led_colors;
+
+void show_led(uint32_t word, bool force = false)
 {
-    return fmod(n + hue/60.0, 6);
+    if (led_out && (force || led_cache.fresh(word)))
+        led_out->write_frame(word);
 }
 
-double hsv_f(int n, double hue,double s, double v)
+void set_led(int32_t md, int br, bool off = false)
 {
-    double k = hsv_k(n,hue);
-    return v - v * s * max( { min( {k, 4-k, 1.0} ), 0.0 } );
+    if (off)
+        show_led(led_word(br, 0, 0, 190), true);
+    else
+        show_led(led_colors.lookup_md(md, br * led_brightness_map::per_br));
 }
 
-vector<int> hsv2rgb(double h, double s, double v)
+// time a few blank frames on a led bus, for the startup comparison
+void led_bus_probe(led_bus* bus, int frames = 20)
 {
-    double hue = h * 360;
-    int r = int(hsv_f(5,hue, s, v)*255);
-    int g = int(hsv_f(3,hue, s, v)*255);
-    int b = int(hsv_f(1,hue, s, v)*255);
-    vector<int> rgb;
-    rgb.push_back(r);
-    rgb.push_back(g);
-    rgb.push_back(b);
-    return rgb;
+    unsigned long ioctls0 = led_syscalls;
+    int64_t t0 = monotonic_ns();
+    for (int i = 0; i < frames; i++)
+        bus->write_frame(led_word(0, 0, 0, 0));
+    double us = (monotonic_ns() - t0) / 1e3;
+    cout<<"led bus ["<<bus->name()<<"]: "<<(led_syscalls - ioctls0) / frames<<" syscalls/frame, "
+        <<us / frames<<" us/frame"<<endl;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
-//https://github.com/pimoroni/fanshim-python/issues/19#issuecomment-517478717
-//////////////////////////////////////////////////////////////////////////////////////////
-inline static void write_byte(uint8_t byte)
+// led_bus: 0 = libgpiod line_bulk (default), 1 = libgpiod single lines, 2 = /dev/gpiomem registers,
+// 3 = /dev/spidev<spi_bus>.<spi_cs>
+led_bus* open_led_bus(int kind, int spi_bus = 0, int spi_cs = 0)
 {
-    for (int n = 0; n < 8; n++)
+    gpiod::line_request lrq({"fanshim", gpiod::line_request::DIRECTION_OUTPUT, 0});
+
+    if (kind == 3)
     {
-        ln_led_dat.set_value((byte & (1 << (7 - n))) > 0);
-        ln_led_clk.set_value(HIGH);
-        // nano_usleep_frac(CLCK_STRETCH);
-        ln_led_clk.set_value(LOW);
-        // nano_usleep_frac(CLCK_STRETCH);
+        string dev = "/dev/spidev" + to_string(spi_bus) + "." + to_string(spi_cs);
+        try {
+            return new led_bus_spi(led_bus_spi::open_sink(dev));
+        } catch (exception &e) {
+            cout<<"spidev led bus unavailable ("<<e.what()<<"), using libgpiod"<<endl;
+        }
     }
-}
 
-void set_led(double tmp, int br,int hi, int lo, bool off = false)
-{
-    
-    int r = 0, g = 0, b = 0;
-    
-    if (off) {
-        r = 0;
-        g = 0;
-        b = 190;
-    } 
-    else if (br != 0)
+    if (kind == 2)
     {
-        double s, v;
-        s = 1;
-        v = br/31.0;
-        //// hsv: hue from temperature; s set to 1, v set to brightness like the official code https://github.com/pimoroni/fanshim-python/blob/5841386d252a80eeac4155e596d75ef01f86b1cf/examples/automatic.py#L44
-        
-        vector<int> rgb = hsv2rgb(tmp2hue(tmp, hi, lo), s, v);
-        r = rgb.at(0);
-        g = rgb.at(1);
-        b = rgb.at(2);
+        try {
+            return new led_bus_gpiomem(led_bus_gpiomem::map());
+        } catch (exception &e) {
+            cout<<"gpiomem led bus unavailable ("<<e.what()<<"), using libgpiod"<<endl;
+        }
     }
 
-    
-    //start frame
-    ln_led_dat.set_value(LOW);
-    for (int i = 0; i < 32; ++i)
+    if (kind == 1)
     {
-        ln_led_clk.set_value(HIGH);
-        // nano_usleep_frac(CLCK_STRETCH);
-        ln_led_clk.set_value(LOW);
-        // nano_usleep_frac(CLCK_STRETCH);
+        gpiod::line ln_led_dat = rchip.get_line(led_dat_pin);
+        ln_led_dat.request(lrq, 0);
+
+        gpiod::line ln_led_clk = rchip.get_line(led_clck_pin);
+        ln_led_clk.request(lrq, 0);
+        return new led_bus_lines<gpiod::line>(ln_led_clk, ln_led_dat);
     }
-    
-    // A 32 bit LED frame for each LED in the string (<0xE0+brightness> <blue> <green> <red>)
-    write_byte(0b11100000 | br); // in range of 0..31 for the fanshim
-    write_byte(b); // b
-    write_byte(g); // g
-    write_byte(r); // r
-    
-    // An end frame consisting of at least (n/2) bits of 1, where n is the number of LEDs in the string
-    ln_led_dat.set_value(HIGH);
-    for (int i = 0; i < 1; ++i)
+
+    gpiod::line_bulk ln_led = rchip.get_lines({led_clck_pin, led_dat_pin});
+    ln_led.request(lrq, {0, 0});
+    return new led_bus_bulk<gpiod::line_bulk>(ln_led);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+
+// "animation": {"gamma": 2.2, "keyframes": [{"t": 0, "level": 0}, {"t": 1.5, "level": 1, "ease": "sine"}, ...]}
+vector<led_keyframe> parse_keyframes(const json& j, double& gamma)
+{
+    const map<string, led_ease> eases {
+        {"linear", led_ease::linear},
+        {"step", led_ease::step},
+        {"sine", led_ease::sine},
+        {"exp", led_ease::exp}
+    };
+
+    gamma = j.value("gamma", 1.0);
+    vector<led_keyframe> keys;
+    for (auto& k : j.at("keyframes"))
     {
-        ln_led_clk.set_value(HIGH);
-        // nano_usleep_frac(CLCK_STRETCH);
-        ln_led_clk.set_value(LOW);
-        // nano_usleep_frac(CLCK_STRETCH);
+        string ease = k.value("ease", "linear");
+        if (eases.count(ease) == 0)
+            throw runtime_error("unknown ease " + ease);
+        keys.push_back({k.at("t").get<double>(), k.at("level").get<double>(), eases.at(ease)});
     }
-    
+
+    if (keys.empty() || keys.front().t != 0 || gamma <= 0
+        || !is_sorted(keys.begin(), keys.end(), [](const led_keyframe& a, const led_keyframe& b){return a.t < b.t;}))
+    {
+        throw runtime_error("keyframes must start at t = 0 and be sorted by t");
+    }
+    return keys;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
+// "palette": [{"t": 40, "color": [0, 0, 255]}, {"t": 50, "color": [0, 255, 0]}, ...]
+vector<led_color_stop> parse_palette(const json& j)
+{
+    vector<led_color_stop> stops;
+    for (auto& st : j)
+    {
+        const json& c = st.at("color");
+        if (c.size() != 3)
+            throw runtime_error("color must be [r, g, b]");
+        for (auto& v : c)
+            if (v.get<int>() < 0 || v.get<int>() > 255)
+                throw runtime_error("color values must be 0 to 255");
+        stops.push_back({st.at("t").get<double>(), uint8_t(c[0].get<int>()), uint8_t(c[1].get<int>()), uint8_t(c[2].get<int>())});
+    }
 
+    if (stops.empty()
+        || !is_sorted(stops.begin(), stops.end(), [](const led_color_stop& a, const led_color_stop& b){return a.t < b.t;}))
+    {
+        throw runtime_error("palette stops must be sorted by t");
+    }
+    return stops;
+}
 
-map<string, int>  get_fs_conf()
+// "sensors": {"root": "/sys", "policy": "max" | "mean" | "threshold",
+//             "zones": {"cpu-thermal": {"weight": 2, "on": 70, "off": 60}, ...},
+//             "stale": 60, "stuck": 900, "slow_ms": 50}
+// zones are matched by type/name or by id (e.g. "thermal_zone0", "hwmon0/temp1_input")
+void setup_sensors(temp_sensor_set& sensors, const json& fs_extra)
 {
-    map<string, int> fs_conf_default {
-        {"on-threshold", 60},
-        {"off-threshold", 50},
-        {"budget",3},
-        {"delay", 10},
-        {"brightness",0},
-        {"blink", 0},
-        {"breath_brgt",10}
+    const map<string, temp_policy> policies {
+        {"max", temp_policy::max},
+        {"mean", temp_policy::mean},
+        {"threshold", temp_policy::threshold}
     };
-    
-    map<string, int> fs_conf = fs_conf_default;
-    
-    try
+    json j = fs_extra.value("sensors", json::object());
+
+    sensors.discover(j.value("root", "/sys"));
+    if (sensors.sources.empty())
     {
-        ifstream fs_cfg_file("/usr/local/etc/fanshim.json");
-        json fs_cfg_custom;
-        fs_cfg_file >> fs_cfg_custom;
-        
-        for (auto& el : fs_cfg_custom.items()) {
-            fs_conf[el.key()] = el.value();
+        cout<<"no temperature sensors discovered, using thermal_zone0"<<endl;
+        sensors.add("/sys/class/thermal/thermal_zone0/temp");
+    }
+
+    try {
+        string policy = j.value("policy", "max");
+        if (policies.count(policy) == 0)
+            throw runtime_error("unknown policy " + policy);
+        sensors.policy = policies.at(policy);
+
+        for (auto& el : j.value("zones", json::object()).items())
+        {
+            temp_source* src = sensors.find(el.key());
+            if (!src)
+            {
+                cout<<"sensor zone "<<el.key()<<" not found"<<endl;
+                continue;
+            }
+            src->weight = el.value().value("weight", 1);
+            src->on_md = int32_t(lround(el.value().value("on", 0.0) * 1000));
+            src->off_md = int32_t(lround(el.value().value("off", 0.0) * 1000));
+            if (src->weight < 0 || src->on_md < src->off_md)
+                throw runtime_error("bad settings for zone " + el.key());
         }
-        
-        if ( (fs_conf["on-threshold"] <= fs_conf["off-threshold"]) 
-            || (fs_conf["budget"] <= 0) || (fs_conf["delay"] <= 0) 
-            || (fs_conf["breath_brgt"]<=0) || (fs_conf["breath_brgt"]>31) 
-            || fs_conf["blink"]<0 || fs_conf["blink"]>2 )
+    } catch (exception &e) {
+        cout<<"error parsing sensors: "<<e.what()<<", using the max of all zones"<<endl;
+        sensors.policy = temp_policy::max;
+    }
+
+    try {
+        sensor_health_limits lim;
+        lim.stale_ms = int64_t(j.value("stale", 60.0) * 1000);
+        lim.stuck_ms = int64_t(j.value("stuck", 900.0) * 1000);
+        lim.slow_us = int64_t(j.value("slow_ms", 50.0) * 1000);
+        if (lim.stale_ms <= 0 || lim.stuck_ms < 0 || lim.slow_us <= 0)
+            throw runtime_error("stale and slow_ms must be positive, stuck not negative");
+        sensors.limits = lim;
+    } catch (exception &e) {
+        cout<<"error parsing sensor health limits: "<<e.what()<<", using the defaults"<<endl;
+    }
+
+    for (auto& src : sensors.sources)
+        cout<<"sensor "<<src.id<<" ("<<src.name<<"), weight "<<src.weight<<endl;
+}
+
+// "filter": {"sample_ms": 250, "chain": ["median", "ewma", "slew"], "median": 5, "ewma_alpha": 0.25, "slew": 2}
+// returns the sub-second sampling period in ms, 0: one sample per check
+int setup_filters(temp_filter_chain& filters, const json& fs_extra)
+{
+    const map<string, temp_filter_kind> kinds {
+        {"median", temp_filter_kind::median},
+        {"ewma", temp_filter_kind::ewma},
+        {"slew", temp_filter_kind::slew}
+    };
+    if (!fs_extra.contains("filter"))
+        return 0;
+
+    try {
+        const json& j = fs_extra["filter"];
+        int sample_ms = j.value("sample_ms", 0);
+        if (sample_ms < 0)
+            throw runtime_error("sample_ms must be positive");
+
+        filters.median = median_filter(j.value("median", 5));
+        filters.ewma = ewma_filter(int(lround(j.value("ewma_alpha", 0.25) * 1024)));
+        filters.slew = slew_filter(int32_t(lround(j.value("slew", 2.0) * 1000)));
+        for (auto& k : j.value("chain", json::array()))
         {
-            throw runtime_error("sanity check");
+            string name = k.get<string>();
+            if (kinds.count(name) == 0)
+                throw runtime_error("unknown filter " + name);
+            if (!filters.add(kinds.at(name)))
+                throw runtime_error("too many filters");
         }
-        
+        cout<<"sampling every "<<sample_ms<<" ms, "<<filters.size()<<" filter(s)"<<endl;
+        return sample_ms;
+    } catch (exception &e) {
+        cout<<"error parsing filter: "<<e.what()<<", no filtering"<<endl;
+        filters = temp_filter_chain();
+        return 0;
     }
-    catch (exception &e)
+}
+
+// the animation played while the fan is off, by blink mode; an empty one means a steady LED
+led_animation get_led_animation(map<string, int>& fs_conf, const json& fs_extra)
+{
+    led_animation anim;
+    int blink = fs_conf["blink"];
+    int fps = fs_conf["led_fps"];
+
+    if (blink == 3)
     {
-        cout<<"error parsing config file: "<<e.what()<<endl;
-        fs_conf = fs_conf_default;
+        try {
+            double gamma = 1;
+            vector<led_keyframe> keys = parse_keyframes(fs_extra.at("animation"), gamma);
+            anim.render(keys, fs_conf["brightness"] * led_brightness_map::per_br, gamma, fps);
+            return anim;
+        } catch (exception &e) {
+            cout<<"error parsing animation: "<<e.what()<<", breathing instead"<<endl;
+            blink = 2;
+        }
     }
-    
-    for (map<string,int>::iterator it=fs_conf.begin(); it!=fs_conf.end(); ++it)
-        cout << it->first << " => " << it->second << endl;
-    
-    return fs_conf;
-}
 
+    if (blink == 1)
+    {
+        // 500 ms on, 500 ms off
+        anim.render({ {0, 1, led_ease::linear}, {0.5, 0, led_ease::step}, {1, 1, led_ease::step} },
+                    fs_conf["brightness"] * led_brightness_map::per_br, 1, fps);
+    }
+    else if (blink == 2)
+    {
+        // 0 .. breath_brgt .. 0 and back, over breath_brgt / 5 seconds; at led_fps above 10 the extra
+        // frames land on the finer brightness levels in between
+        double half = fs_conf["breath_brgt"] / 10.0;
+        anim.render({ {0, 0, led_ease::linear}, {half, 1, led_ease::linear}, {2 * half, 0, led_ease::linear} },
+                    fs_conf["breath_brgt"] * led_brightness_map::per_br, 1, fps);
+    }
+    return anim;
+}
 
-void blk_led(double tmp, int br, int on_threshold, int off_threshold,int delay)
+// ln_fan has to be requested unless the mode is sysfs pwm (requesting the line takes the pin off the pwm function)
+fan_output* open_fan(const fan_pwm_conf& conf)
 {
-    struct timespec ti;
-    ti.tv_sec = 0;
-    ti.tv_nsec = 500*1000*1000;
-    for (int i = 1; i <= delay; i++)
+    fan_output* fan = nullptr;
+    if (conf.mode == 2)
     {
-        // set_led(tmp, ( (i % 2) * br ), on_threshold, off_threshold);
-        set_led(tmp, br, on_threshold, off_threshold); 
-        nanosleep(&ti, NULL);
-        set_led(tmp, 0, on_threshold, off_threshold); 
-        nanosleep(&ti, NULL);
+        try {
+            fan = new fan_pwm_sysfs(conf.root, conf.chip, conf.channel, conf.freq);
+        } catch (exception &e) {
+            cout<<"sysfs pwm unavailable ("<<e.what()<<"), fan on/off only"<<endl;
+            gpiod::line_request lrq({"fanshim", gpiod::line_request::DIRECTION_OUTPUT, 0});
+            ln_fan = rchip.get_line(fanshim_pin);
+            ln_fan.request(lrq, 0);
+            return new fan_switch<gpiod::line>(ln_fan);
+        }
+    }
+    else if (conf.mode == 1)
+    {
+        fan_pwm_soft<gpiod::line>* soft = new fan_pwm_soft<gpiod::line>(ln_fan, conf.freq);
+        soft->start();
+        fan = soft;
     }
+    else
+        return new fan_switch<gpiod::line>(ln_fan);
+
+    fan->kick_ms = conf.kick_ms;
+    return fan;
 }
 
-void breath_led(double tmp, int brth, int on_threshold, int off_threshold, int delay, int* brs)
+
+// LED rendering on its own timerfd-driven thread at a fixed frame rate, so blinking/breathing never
+// holds up the temperature sampling. The control loop hands over the latest temperature and fan state
+// with a single atomic store; the thread picks them up on its next frame.
+// Animations are pre-rendered, a frame is two table lookups with no floating point math.
+class led_animator
 {
-    struct timespec req;
-     req.tv_sec = 0;
-     req.tv_nsec = (long)(100 * 1000 * 1000);
+public:
+    led_animator(int br, int fps, const led_animation& anim) : level(br * led_brightness_map::per_br), fps(fps), anim(anim) {}
+
+    void update(int32_t md, bool fan_on)
+    {
+        // one 32-bit word, lock-free on every Pi: millidegrees never need the top bit
+        state.store(int32_t(uint32_t(md) << 1 | uint32_t(fan_on)), memory_order_release);
+    }
 
-     for (int i=0; i<10*delay; i++)
+    // brightness level of the last frame
+    int current_level() const { return shown.load(memory_order_relaxed); }
+
+    void start()
+    {
+        running = true;
+        th = start_thread_without_signals(&led_animator::run, this);
+    }
+
+    void stop()
+    {
+        running = false;
+        if (th.joinable())
+            th.join();
+    }
+
+private:
+    const int level, fps;
+    const led_animation anim;
+    atomic<int32_t> state{0};     // md << 1 | fan_on
+    atomic<int> shown{0};
+    atomic<bool> running{false};
+    thread th;
+
+    void run()
+    {
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tfd < 0)
         {
-            // cout<<brs[br_counter]<<endl;
-            set_led(tmp, brs[br_counter], on_threshold, off_threshold); 
-            if (br_counter >= 2*brth -1)
-                br_counter = 0;
-            else
-                br_counter++;
-            nanosleep(&req , NULL);
+            cout<<"led thread: timerfd_create failed: "<<strerror(errno)<<endl;
+            return;
         }
-}
+        long period_ns = 1000000000L / fps;
+        struct itimerspec its;
+        its.it_interval.tv_sec = period_ns / 1000000000L;
+        its.it_interval.tv_nsec = period_ns % 1000000000L;
+        its.it_value = its.it_interval;
+        timerfd_settime(tfd, 0, &its, NULL);
+
+        uint64_t frame = 0, expirations;
+        while (running)
+        {
+            if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
+            // frames missed while descheduled are skipped, the animation stays on the wall clock
+            frame += expirations;
+
+            int32_t st = state.load(memory_order_acquire);
+            int32_t md = st >> 1;
+            bool fan_on = st & 1;
+
+            int l = anim.size() != 0 && !fan_on ? anim.level(frame) : level;
+            shown.store(l, memory_order_relaxed);
+            show_led(led_colors.lookup_md(md, l));
+        }
+        close(tfd);
+    }
+};
+
+led_animator* led_anim = nullptr;
+
+// on-device record of every check, see fanshim_histdump
+const string history_path = "/usr/local/etc/fanshim_history.bin";
+history_log* history = nullptr;
+
+// this node's thermal model, written by fanshim_fit from the history
+const string model_path = "/usr/local/etc/fanshim_model.json";
 
 void signalHandler( int signum ) {
    cout << "Signal: " << signum << endl;
    if (signum == SIGTERM || signum == SIGINT)
     {
-        set_led(1, 3, 1, 1, true);
+        if (led_anim)
+            led_anim->stop();
+        if (fan_out)
+            fan_out->shutdown();
+        set_led(1, 3, true);
+        if (history)
+            history->sync();
         cout<<"closed"<<endl;
         exit(0);
     }
@@ -245,70 +472,162 @@ void signalHandler( int signum ) {
 int main (void)
 {
     signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
     gpiod::line_request lrq({"fanshim", gpiod::line_request::DIRECTION_OUTPUT, 0});
 
+    json fs_extra = json::object();
+    map<string, int> fs_conf = get_fs_conf(fs_extra);
+    led_cache.refresh_sec = fs_conf["led_refresh"];
+    fan_curve fan_speed;
+    const fan_pwm_conf pwm_conf = parse_fan_pwm(fs_extra, fan_speed);
+    fan_logic_conf logic_conf = get_fan_logic_conf(fs_conf, fs_extra, pwm_conf.mode, fan_speed);
+
     try {
         const string chipname = "gpiochip0";
         
         rchip = gpiod::chip(chipname, gpiod::chip::OPEN_BY_NAME);
 
-        ln_fan = rchip.get_line(fanshim_pin);
-        ln_fan.request(lrq, 0);
-
-        ln_led_dat = rchip.get_line(led_dat_pin);
-        ln_led_dat.request(lrq, 0);
+        if (pwm_conf.mode != 2)
+        {
+            ln_fan = rchip.get_line(fanshim_pin);
+            ln_fan.request(lrq, 0);
+        }
+        fan_out = open_fan(pwm_conf);
+        cout<<"fan output: "<<fan_out->name()<<endl;
 
-        ln_led_clk = rchip.get_line(led_clck_pin);
-        ln_led_clk.request(lrq, 0);
+        led_out = open_led_bus(fs_conf["led_bus"], fs_conf["spi_bus"], fs_conf["spi_cs"]);
+        led_bus_probe(led_out);
 
     } catch (...) {
         cout<<"init error"<<endl;
     }
+    if (!fan_out)
+        fan_out = new fan_switch<gpiod::line>(ln_fan);
     cout<<"fanshim init."<<endl;
     
     
-    map<string, int> fs_conf = get_fs_conf();
-    
-    
     const int delay_sec = fs_conf["delay"];
-    const int on_threshold = fs_conf["on-threshold"];
-    const int off_threshold = fs_conf["off-threshold"];
-    const int budget = fs_conf["budget"];
+    // millidegrees from here on, the thresholds may be fractional in the config file
+    const int32_t on_md = fs_conf["on-threshold-md"];
+    const int32_t off_md = fs_conf["off-threshold-md"];
 
-    const struct timespec sleep_delay{delay_sec,0L};
+    led_colors.build(on_md, off_md);
+    if (fs_extra.contains("palette"))
+    {
+        try {
+            led_colors.build(parse_palette(fs_extra["palette"]));
+        } catch (exception &e) {
+            cout<<"error parsing palette: "<<e.what()<<", red to green instead"<<endl;
+        }
+    }
+
+    // adaptive: sampling interval between delay_min and delay_max, budget counts as (budget - 1) * delay seconds
+    const bool adaptive = logic_conf.adaptive;
+    adaptive_schedule sched(fs_conf["delay_min"] * 1000L, fs_conf["delay_max"] * 1000L, on_md, off_md);
+    loop_metrics metrics;
+
+    // this node's thermal model, mpc plans with it
+    thermal_model& plant = logic_conf.model;
+    if (filesystem::exists(model_path))
+    {
+        try {
+            plant = read_thermal_model(model_path);
+            cout<<"thermal model: "<<model_path<<", settles idle at "<<fixed_str(llround(plant.steady_md(0, 0)), 3)
+                <<", full load at "<<fixed_str(llround(plant.steady_md(1, 0)), 3)<<" (fan off) / "
+                <<fixed_str(llround(plant.steady_md(1, 1)), 3)<<" (fan on)"<<endl;
+        } catch (exception &e) {
+            cout<<"thermal model ignored: "<<e.what()<<endl;
+        }
+    }
+    else if (logic_conf.mpc.on)
+        cout<<"mpc: no "<<model_path<<", planning with the default model (see fanshim_fit)"<<endl;
+
+    // the decision of each check: thresholds and budget, then
+    // predict: also start the fan when the trend of the last predict_window samples
+    // crosses on-threshold within predict_horizon seconds;
+    // feed-forward: start the fan when cpu utilisation (percent, /proc/stat) is at least load_on, or cpu
+    // pressure stall (some avg10, percent) at least psi_on, for load_budget checks in a row; 0 disables;
+    // pid: holds setpoint by the duty instead of switching at the thresholds; with autotune the relay
+    // runs first and its limit cycle gives the gains;
+    // mpc: picks the duty from the cheapest fan schedule over the next few checks under the model
+    fan_logic logic(logic_conf, &cout);
+
+    const int load_on = logic_conf.load_on, psi_on = logic_conf.psi_on;
+    cpu_load_reader cpu_load("/proc", psi_on > 0);
+    int32_t load_pm = 0, psi_x100 = 0;
+    if (psi_on > 0 && !cpu_load.has_pressure())
+        cout<<"/proc/pressure/cpu not available, psi_on ignored"<<endl;
+    int64_t now_ms, interval_ms = delay_sec * 1000L;
+    int duty = 0;
     
     int read_fs_pin = 0;
     
     const string node_hdr = "# HELP cpu_fanshim text file output: fan state.\n# TYPE cpu_fanshim gauge\ncpu_fanshim ";
+    const string node_hdr_dt = "# HELP cpu_fanshim_duty text file output: fan pwm duty, percent.\n# TYPE cpu_fanshim_duty gauge\ncpu_fanshim_duty ";
+    const string node_hdr_at = "# HELP cpu_fanshim_pid_autotune text file output: 1 while the pid gains are being auto-tuned.\n# TYPE cpu_fanshim_pid_autotune gauge\ncpu_fanshim_pid_autotune ";
     const string node_hdr_t = "# HELP cpu_temp_fanshim text file output: temp.\n# TYPE cpu_temp_fanshim gauge\ncpu_temp_fanshim ";
+    const string node_hdr_raw = "# HELP cpu_temp_raw_fanshim text file output: temp before filtering.\n# TYPE cpu_temp_raw_fanshim gauge\ncpu_temp_raw_fanshim ";
+    const string node_hdr_led = "# HELP cpu_fanshim_led_frames text file output: LED frames sent to the bus or suppressed as unchanged.\n# TYPE cpu_fanshim_led_frames counter\n";
+    const string node_hdr_wk = "# HELP cpu_fanshim_wakeups_per_hour text file output: temperature samples per hour since start.\n# TYPE cpu_fanshim_wakeups_per_hour gauge\ncpu_fanshim_wakeups_per_hour ";
+    const string node_hdr_iv = "# HELP cpu_fanshim_interval_seconds text file output: time until the next temperature sample.\n# TYPE cpu_fanshim_interval_seconds gauge\ncpu_fanshim_interval_seconds ";
+    const string node_hdr_pr = "# HELP cpu_temp_predicted_fanshim text file output: temp projected predict_horizon seconds ahead.\n# TYPE cpu_temp_predicted_fanshim gauge\ncpu_temp_predicted_fanshim ";
+    const string node_hdr_pe = "# HELP cpu_fanshim_prediction_error text file output: mean absolute error of the projections that came due, in degrees.\n# TYPE cpu_fanshim_prediction_error gauge\ncpu_fanshim_prediction_error ";
+    const string node_hdr_ld = "# HELP cpu_fanshim_cpu_load text file output: cpu utilisation since the last check, percent.\n# TYPE cpu_fanshim_cpu_load gauge\ncpu_fanshim_cpu_load ";
+    const string node_hdr_psi = "# HELP cpu_fanshim_cpu_pressure text file output: cpu pressure stall, some avg10, percent.\n# TYPE cpu_fanshim_cpu_pressure gauge\ncpu_fanshim_cpu_pressure ";
+    const string node_hdr_sl = "# HELP cpu_fanshim_sensor_read_seconds text file output: latency of the last read of each temperature source.\n# TYPE cpu_fanshim_sensor_read_seconds gauge\n";
+    const string node_hdr_sm = "# HELP cpu_fanshim_sensor_read_max_seconds text file output: slowest read of each temperature source since start.\n# TYPE cpu_fanshim_sensor_read_max_seconds gauge\n";
+    const string node_hdr_sr = "# HELP cpu_fanshim_sensor_reads_total text file output: reads of each temperature source.\n# TYPE cpu_fanshim_sensor_reads_total counter\n";
+    const string node_hdr_se = "# HELP cpu_fanshim_sensor_errors_total text file output: failed reads of each temperature source.\n# TYPE cpu_fanshim_sensor_errors_total counter\n";
+    const string node_hdr_ss = "# HELP cpu_fanshim_sensor_slow_reads_total text file output: reads of each temperature source slower than slow_ms.\n# TYPE cpu_fanshim_sensor_slow_reads_total counter\n";
+    const string node_hdr_so = "# HELP cpu_fanshim_sensor_reopens_total text file output: times a failing temperature source was reopened.\n# TYPE cpu_fanshim_sensor_reopens_total counter\n";
+    const string node_hdr_st = "# HELP cpu_fanshim_sensor_stuck text file output: 1 while a temperature source keeps returning the exact same value.\n# TYPE cpu_fanshim_sensor_stuck gauge\n";
+    const string node_hdr_fs = "# HELP cpu_fanshim_failsafe text file output: 1 while no usable temperature could be read and the fan is in its fail-safe state.\n# TYPE cpu_fanshim_failsafe gauge\ncpu_fanshim_failsafe ";
+    const string node_hdr_mp = "# HELP cpu_fanshim_mpc_peak text file output: peak temp of the chosen fan schedule over the mpc horizon.\n# TYPE cpu_fanshim_mpc_peak gauge\ncpu_fanshim_mpc_peak ";
+    const string node_hdr_re = "# HELP cpu_fanshim_reaction_seconds text file output: last fan start, from the last sample below on-threshold.\n# TYPE cpu_fanshim_reaction_seconds gauge\ncpu_fanshim_reaction_seconds ";
     string nodex_out = "";
     
-    fstream tmp_file;
-    float tmp = 0;
-    deque<int> tmp_q (budget, 0.0);
-    int j;
-    bool all_low,all_high;
+    int32_t tmp_md = 0, raw_md = 0;
+    int tmp_err;
     
-    tmp_file.open("/sys/class/thermal/thermal_zone0/temp", ios_base::in);
+    temp_sensor_set tmp_sensors;
+    setup_sensors(tmp_sensors, fs_extra);
+
+    // raw samples (every sample_ms in between checks when set) go through the filters, the checks use the output
+    temp_filter_chain filters;
+    const int sample_ms = setup_filters(filters, fs_extra);
+    auto sample = [&](int64_t t_ms) {
+        int err = tmp_sensors.read(raw_md, on_md, off_md);
+        if (err == 0)
+            tmp_md = filters.apply(t_ms, raw_md);
+        return err;
+    };
+    // one line per temperature source, labelled with its id
+    auto per_sensor = [&](const string& hdr, const string& name, auto value) {
+        nodex_out += hdr;
+        for (auto& src : tmp_sensors.sources)
+            nodex_out += name + "{sensor=\"" + src.id + "\"} " + value(src.health) + "\n";
+    };
     
     
     ///override file
     filesystem::path override_fp("/usr/local/etc/.force_fanshim");
     
+    ///history log: written in place every check, flushed to disk every history_sync seconds
+    if (fs_conf["history"] > 0)
+    {
+        try {
+            history = new history_log(history_path, fs_conf["history"]);
+            cout<<"history: "<<history_path<<", "<<history->count() - history->first()<<" of "<<history->capacity()<<" records kept"<<endl;
+        } catch (exception &e) {
+            cout<<"history log disabled: "<<e.what()<<endl;
+        }
+    }
+    const int64_t history_sync_ms = fs_conf["history_sync"] * 1000L;
+    int64_t last_sync_ms = monotonic_ms();
+    
     
     ///led
     int br = fs_conf["brightness"];
-    int brt_br = fs_conf["breath_brgt"];
-    int *brs = new int[brt_br*2];
-
-    for (int i=0;i<brt_br*2;i++)
-          {
-            if (i<=brt_br)
-                brs[i] = i;
-            else
-                brs[i]=2*brt_br-i;
-          }
-    
     
     if (br > 31) {
         br = 31;
@@ -318,87 +637,130 @@ int main (void)
         br = 0;
         cout<<"brightness lower than min = 0, set to 0"<<endl;
     }
+    fs_conf["brightness"] = br;
 
 
     
     
     if (br == 0)
     {
-        set_led(0,0,on_threshold,off_threshold);
+        set_led(0,0);
     } 
+    else
+    {
+        led_anim = new led_animator(br, fs_conf["led_fps"], get_led_animation(fs_conf, fs_extra));
+        led_anim->start();
+    }
 
     
     while(1){
-        tmp_file >> tmp;
-        tmp_file.seekg(0, tmp_file.beg);
-        tmp = tmp/1000;
-        tmp_q.push_back(int(tmp));
-        tmp_q.pop_front();
-        deque<int> (tmp_q).swap(tmp_q);
-        
-        cout<<"Temp: "<<tmp<<", last "<<budget<<": [ ";
-        for (j =0; j<tmp_q.size(); j++)
-        {
-            cout << tmp_q.at(j) <<" ";
-        }
-        cout<<"]\n";
-        
-        all_low = all_of(tmp_q.begin(), tmp_q.end(), [=](int tx){return tx<off_threshold;});
-        all_high = all_of(tmp_q.begin(), tmp_q.end(), [=](int tx){return tx>on_threshold;});
-        
-        cout<<"all low: "<< boolalpha << all_low <<"; ";
-        cout<<"all high: "<< boolalpha << all_high <<endl;
-        
+        now_ms = monotonic_ms();
+        tmp_err = sample(now_ms);
+        for (auto& src : tmp_sensors.sources)
+            if (src.health.stuck)
+                cout<<src.reader->source()<<" stuck at "<<fixed_str(src.last_md, 3)<<", ignored"<<endl;
+            else if (src.err == -EAGAIN)
+                cout<<src.reader->source()<<" failing, reopening in "<<src.health.retry_ms - now_ms<<" ms"<<endl;
+            else if (src.err != 0)
+                cout<<"error reading "<<src.reader->source()<<": "<<strerror(-src.err)<<endl;
+        if (tmp_err != 0)
+            cout<<"no temperature could be read, keeping last value"<<endl;
+        metrics.sample(now_ms, tmp_md > on_md);
+
+        fan_inputs in{now_ms, tmp_md, fan_out->duty()};
+        // the history records the load as well, for fanshim_fit; mpc plans with it
+        if ((load_on > 0 || history || logic_conf.mpc.on) && cpu_load.read_load(load_pm) == 0)
+            in.load_pm = load_pm;
+        if (psi_on > 0 && cpu_load.read_pressure(psi_x100) == 0)
+            in.psi_x100 = psi_x100;
+        /// no usable temperature for a while: fail-safe fan state (1: on, 0: off, 2: leave as is)
+        in.stale = tmp_sensors.stale(now_ms);
         //override
-        if ( filesystem::exists(override_fp) )
-        {
-            all_high = true;
-            all_low = false;
-            cout<<"forcing fan on: override effective."<<endl;
-        }
-        
-        read_fs_pin = ln_fan.get_value();
+        in.override_on = filesystem::exists(override_fp);
+
+        duty = logic.decide(in);
+        if (logic.switched_on)
+            metrics.fan_switched_on(monotonic_ms());
         
-        if(all_high && read_fs_pin == LOW)
+        fan_out->set_duty(duty, monotonic_ms());
+        if (fan_out->kick_until() >= 0)
         {
-            ln_fan.set_value(HIGH);
-        }
-        else
-        {
-            if(all_low && read_fs_pin == HIGH)
-            {
-                ln_fan.set_value(LOW);
-            }
+            sleep_until_ms(fan_out->kick_until());
+            fan_out->end_kick();
         }
         
-        
-        read_fs_pin = ln_fan.get_value();
-        cout<<"fan state now: "<< (read_fs_pin == LOW ? "[off]" : "[on]") <<endl;
+        read_fs_pin = fan_out->on() ? HIGH : LOW;
+        cout<<"fan state now: "<< (read_fs_pin == LOW ? "[off]" : "[on]");
+        if (pwm_conf.mode != 0)
+            cout<<", duty "<<fixed_str(fan_out->duty(), 1)<<"%";
+        cout<<endl;
         
         ofstream nodex_fs;
         nodex_fs.open("/usr/local/etc/node_exp_txt/cpu_fan.prom");
         nodex_out = node_hdr + to_string(read_fs_pin) + "\n";
-        nodex_out += node_hdr_t + to_string(int(tmp)) + "\n";
+        if (pwm_conf.mode != 0)
+            nodex_out += node_hdr_dt + fixed_str(fan_out->duty(), 1) + "\n";
+        if (logic.planner())
+            nodex_out += node_hdr_mp + fixed_str(llround(logic.planner()->peak_md()), 3) + "\n";
+        if (logic.pid_mode())
+            nodex_out += node_hdr_at + to_string(logic.tuning()) + "\n";
+        nodex_out += node_hdr_t + fixed_str(tmp_md, 3) + "\n";
+        nodex_out += node_hdr_raw + fixed_str(raw_md, 3) + "\n";
+        nodex_out += node_hdr_led + "cpu_fanshim_led_frames{result=\"sent\"} " + to_string(led_cache.sent) + "\n";
+        nodex_out += "cpu_fanshim_led_frames{result=\"suppressed\"} " + to_string(led_cache.suppressed) + "\n";
+        if (adaptive)
+            interval_ms = sched.next(now_ms, tmp_md);
+        nodex_out += node_hdr_wk + fixed_str(metrics.wakeups_per_hour_x1000(now_ms), 3) + "\n";
+        nodex_out += node_hdr_iv + fixed_str(interval_ms, 3) + "\n";
+        nodex_out += node_hdr_re + fixed_str(metrics.reaction_ms, 3) + "\n";
+        nodex_out += node_hdr_fs + to_string(logic.failsafe) + "\n";
+        per_sensor(node_hdr_sl, "cpu_fanshim_sensor_read_seconds", [](const sensor_health& h) { return fixed_str(h.last_us, 6); });
+        per_sensor(node_hdr_sm, "cpu_fanshim_sensor_read_max_seconds", [](const sensor_health& h) { return fixed_str(h.max_us, 6); });
+        per_sensor(node_hdr_sr, "cpu_fanshim_sensor_reads_total", [](const sensor_health& h) { return to_string(h.reads); });
+        per_sensor(node_hdr_se, "cpu_fanshim_sensor_errors_total", [](const sensor_health& h) { return to_string(h.errors); });
+        per_sensor(node_hdr_ss, "cpu_fanshim_sensor_slow_reads_total", [](const sensor_health& h) { return to_string(h.slow); });
+        per_sensor(node_hdr_so, "cpu_fanshim_sensor_reopens_total", [](const sensor_health& h) { return to_string(h.reopens); });
+        per_sensor(node_hdr_st, "cpu_fanshim_sensor_stuck", [](const sensor_health& h) { return to_string(h.stuck); });
+        if (load_on > 0)
+            nodex_out += node_hdr_ld + fixed_str(load_pm, 1) + "\n";
+        if (psi_on > 0 && cpu_load.has_pressure())
+            nodex_out += node_hdr_psi + fixed_str(psi_x100, 2) + "\n";
+        if (logic.have_prediction)
+        {
+            nodex_out += node_hdr_pr + fixed_str(logic.predicted_md, 3) + "\n";
+            nodex_out += node_hdr_pe + fixed_str(logic.trend().error_md(), 3) + "\n";
+        }
         nodex_fs<<nodex_out;
         nodex_fs.close();
         
         
-        /// set led
-        if(br !=0){
-            if ( fs_conf["blink"] != 0 && read_fs_pin == LOW )
+        /// led thread picks this up on its next frame
+        if (led_anim)
+            led_anim->update(tmp_md, read_fs_pin == HIGH);
+        
+        if (history)
+        {
+            history->append({realtime_ms(), tmp_md, read_fs_pin == HIGH, led_anim ? led_anim->current_level() : 0,
+                             fan_out->duty(), in.load_pm});
+            if (history_sync_ms > 0 && now_ms - last_sync_ms >= history_sync_ms)
             {
-                if (fs_conf["blink"] == 1)
-                    blk_led(tmp, br, on_threshold, off_threshold, delay_sec);
-                else if (fs_conf["blink"] == 2)
-                    breath_led(tmp, brt_br, on_threshold, off_threshold, delay_sec, brs);
+                history->sync();
+                last_sync_ms = now_ms;
             }
-            else
+        }
+        
+        int64_t next_ms = now_ms + interval_ms;
+        if (sample_ms > 0)
+        {
+            for (int64_t t = now_ms + sample_ms; t < next_ms; t += sample_ms)
             {
-                set_led(tmp, br, on_threshold, off_threshold);
-                nanosleep(&sleep_delay, NULL);
+                sleep_until_ms(t);
+                sample(t);
+                // a wakeup like any check, and a fan-on reaction runs from the last cool sample of either
+                metrics.sample(t, tmp_md > on_md);
             }
         }
-        
+        sleep_until_ms(next_ms);
     }
     
     return 0 ;
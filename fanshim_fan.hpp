@@ -0,0 +1,290 @@
+#ifndef FANSHIM_FAN_HPP
+#define FANSHIM_FAN_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fanshim_time.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// fan output: duty cycle in permille, 0 = off, 1000 = full
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Starting from standstill below full duty, the fan is first driven at full duty for kick_ms:
+// small fans often do not start at a duty they keep spinning at once running. The caller waits
+// for kick_until() and calls end_kick().
+class fan_output
+{
+public:
+    int kick_ms = 0;
+
+    virtual ~fan_output() {}
+    virtual const char* name() const = 0;
+    // before the daemon exits: leave the output in a steady state
+    virtual void shutdown() {}
+
+    void set_duty(int permille, int64_t t_ms)
+    {
+        permille = std::min(std::max(permille, 0), 1000);
+        if (current == 0 && permille > 0 && permille < 1000 && kick_ms > 0)
+        {
+            kick_end = t_ms + kick_ms;
+            pending = permille;
+            write_duty(1000);
+            current = 1000;
+            return;
+        }
+        kick_end = -1;
+        if (permille != current)
+            write_duty(permille);
+        current = permille;
+    }
+
+    // -1 when not kicking
+    int64_t kick_until() const { return kick_end; }
+
+    void end_kick()
+    {
+        if (kick_end < 0)
+            return;
+        kick_end = -1;
+        write_duty(pending);
+        current = pending;
+    }
+
+    int duty() const { return current; }
+    bool on() const { return current > 0; }
+
+protected:
+    virtual void write_duty(int permille) = 0;
+
+private:
+    int current = 0, pending = 0;
+    int64_t kick_end = -1;
+};
+
+// the plain on/off switch: any duty above 0 is full on
+template <typename Line>
+class fan_switch : public fan_output
+{
+public:
+    explicit fan_switch(Line line) : line(line) {}
+
+    const char* name() const { return "switch"; }
+
+protected:
+    void write_duty(int permille) { line.set_value(permille > 0 ? 1 : 0); }
+
+private:
+    Line line;
+};
+
+// Software PWM on a gpio line from its own thread. Edges are placed on absolute deadlines
+// (period start, period start + on time), so time spent in set_value() or a late wakeup does
+// not accumulate into the period; a wakeup missed by more than a period resynchronises.
+// Line: gpiod::line, or anything with a set_value(int)
+template <typename Line>
+class fan_pwm_soft : public fan_output
+{
+public:
+    fan_pwm_soft(Line line, int freq_hz) : line(line), period_ns(1000000000L / std::max(freq_hz, 1)) {}
+
+    ~fan_pwm_soft() { stop(); }
+
+    const char* name() const { return "software pwm"; }
+
+    // a running fan is left on at full speed once nothing toggles the line any more
+    void shutdown() { stop(); }
+
+    void start()
+    {
+        running = true;
+        th = start_thread_without_signals(&fan_pwm_soft::run, this);
+    }
+
+    void stop()
+    {
+        running = false;
+        if (th.joinable())
+            th.join();
+    }
+
+    // periods that started more than a period late since start
+    unsigned long overruns() const { return late.load(std::memory_order_relaxed); }
+
+protected:
+    void write_duty(int permille) { target.store(permille, std::memory_order_relaxed); }
+
+private:
+    Line line;
+    const int64_t period_ns;
+    std::atomic<int> target{0};
+    std::atomic<bool> running{false};
+    std::atomic<unsigned long> late{0};
+    std::thread th;
+
+    void run()
+    {
+        // best effort: a realtime priority keeps the edges on time under load (needs root)
+        struct sched_param sp;
+        sp.sched_priority = 1;
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+
+        int level = -1;
+        auto set = [&](int v) {
+            if (v != level)
+                line.set_value(v);
+            level = v;
+        };
+
+        int64_t t = monotonic_ns();
+        while (running)
+        {
+            int d = target.load(std::memory_order_relaxed);
+            if (d <= 0 || d >= 1000)
+                set(d > 0);
+            else
+            {
+                set(1);
+                sleep_until_ns(t + period_ns * d / 1000);
+                set(0);
+            }
+            t += period_ns;
+            sleep_until_ns(t);
+
+            int64_t now = monotonic_ns();
+            if (now - t > period_ns)
+            {
+                late.fetch_add(1, std::memory_order_relaxed);
+                t = now;
+            }
+        }
+        set(target.load(std::memory_order_relaxed) > 0);
+    }
+};
+
+// Kernel PWM through sysfs, <root>/pwmchip<chip>/pwm<channel> (GPIO18 is PWM0 channel 0 with
+// dtoverlay=pwm). root is "/sys/class/pwm", or a directory laid out like it for tests; the channel
+// is exported if it is not yet. Each duty change is one pwrite() to the kept-open duty_cycle file.
+class fan_pwm_sysfs : public fan_output
+{
+public:
+    fan_pwm_sysfs(const std::string& root, int chip, int channel, int freq_hz)
+        : period_ns(1000000000L / std::max(freq_hz, 1))
+    {
+        std::string chip_dir = root + "/pwmchip" + std::to_string(chip);
+        dir = chip_dir + "/pwm" + std::to_string(channel);
+
+        struct stat st;
+        if (stat(dir.c_str(), &st) != 0)
+        {
+            write_file(chip_dir + "/export", std::to_string(channel));
+            // udev may still be setting up the new directory
+            for (int i = 0; i < 50 && stat(dir.c_str(), &st) != 0; i++)
+                usleep(20000);
+        }
+
+        // duty has to stay below the period at every step
+        write_file(dir + "/duty_cycle", "0");
+        write_file(dir + "/period", std::to_string(period_ns));
+        write_file(dir + "/enable", "1");
+
+        fd = open((dir + "/duty_cycle").c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("open " + dir + "/duty_cycle: " + strerror(errno));
+    }
+
+    ~fan_pwm_sysfs()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    fan_pwm_sysfs(const fan_pwm_sysfs&) = delete;
+    fan_pwm_sysfs& operator=(const fan_pwm_sysfs&) = delete;
+
+    const char* name() const { return "sysfs pwm"; }
+
+    unsigned long write_errors = 0;
+
+protected:
+    void write_duty(int permille)
+    {
+        std::string v = std::to_string(period_ns * permille / 1000) + "\n";
+        if (pwrite(fd, v.data(), v.size(), 0) != ssize_t(v.size()))
+            write_errors++;
+    }
+
+private:
+    const int64_t period_ns;
+    std::string dir;
+    int fd = -1;
+
+    static void write_file(const std::string& path, const std::string& v)
+    {
+        int f = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (f < 0)
+            throw std::runtime_error("open " + path + ": " + strerror(errno));
+        std::string line = v + "\n";
+        ssize_t n = write(f, line.data(), line.size());
+        int err = errno;
+        close(f);
+        if (n != ssize_t(line.size()))
+            throw std::runtime_error("write " + path + ": " + strerror(err));
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// temperature => duty
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct fan_curve_point
+{
+    int32_t md;
+    int permille;
+};
+
+// piecewise linear between the points (sorted by temperature), held outside them; never below
+// min_permille while the fan runs, the duty under which it stalls. No points: always full duty.
+class fan_curve
+{
+public:
+    std::vector<fan_curve_point> points;
+    int min_permille = 0;
+
+    int duty(int32_t md) const
+    {
+        if (points.empty())
+            return 1000;
+        int d;
+        if (md <= points.front().md)
+            d = points.front().permille;
+        else if (md >= points.back().md)
+            d = points.back().permille;
+        else
+        {
+            size_t k = 1;
+            while (points[k].md < md)
+                k++;
+            const fan_curve_point& a = points[k - 1];
+            const fan_curve_point& b = points[k];
+            d = a.permille + int(int64_t(b.permille - a.permille) * (md - a.md) / (b.md - a.md));
+        }
+        return std::max(d, min_permille);
+    }
+};
+
+#endif
@@ -0,0 +1,342 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "json.hpp"
+#include "fanshim_time.hpp"
+#include "fanshim_config.hpp"
+#include "fanshim_control.hpp"
+#include "fanshim_history.hpp"
+#include "fanshim_model.hpp"
+// clang++ fanshim_fit.cpp -O2 -std=c++17 -o fanshim_fit
+
+using json = nlohmann::json;
+using namespace std;
+
+// Fits this node's thermal model (fanshim_model.hpp: ambient, time constant with the fan off and
+// on, temperature rise at idle and per unit of load) to the daemon's history, and writes it where
+// the daemon and fanshim_sim -m pick it up. The fit minimises the error of the model run freely
+// along the recorded fan duty and load, restarted from the measured temperature after each gap.
+// A record holds the duty set at its check and the load since the previous check, so the step
+// from record i - 1 to i runs at duty i - 1 and load i.
+
+void usage()
+{
+    cout<<"fanshim_fit [-f history] [-c trace.csv] [-a ambient] [-o model.json] [-n]\n"
+        <<"  -f  history file (default /usr/local/etc/fanshim_history.bin)\n"
+        <<"  -c  csv instead, with a header naming t_ms, temp, duty (percent) or fan, load (percent):\n"
+        <<"      fanshim_histdump -c or fanshim_sim -t\n"
+        <<"  -a  ambient temperature, held instead of fitted\n"
+        <<"  -o  model file to write (default /usr/local/etc/fanshim_model.json)\n"
+        <<"  -n  fit and report only\n";
+}
+
+struct trace_sample
+{
+    int64_t t_ms;
+    double md;
+    double duty;        // 0..1
+    double load;        // 0..1, NAN: not recorded
+};
+
+vector<trace_sample> read_history(const string& path)
+{
+    history_log log(path);
+    vector<trace_sample> v;
+    for (uint64_t i = log.first(); i < log.count(); i++)
+    {
+        history_entry e;
+        if (log.get(i, e))
+            v.push_back({e.t_ms, double(e.md), e.fan ? (e.duty < 0 ? 1 : e.duty / 1000.0) : 0,
+                         e.load_pm >= 0 ? e.load_pm / 1000.0 : NAN});
+    }
+    return v;
+}
+
+vector<string> split_csv(const string& line)
+{
+    vector<string> f;
+    stringstream ss(line);
+    string x;
+    while (getline(ss, x, ','))
+        f.push_back(x);
+    if (!line.empty() && line.back() == ',')
+        f.push_back("");
+    return f;
+}
+
+vector<trace_sample> read_csv(const string& path)
+{
+    ifstream f(path);
+    if (!f)
+        throw runtime_error("cannot open " + path);
+    string line;
+    if (!getline(f, line))
+        throw runtime_error("empty " + path);
+    vector<string> hdr = split_csv(line);
+    auto col = [&](const string& name) {
+        auto it = find(hdr.begin(), hdr.end(), name);
+        return it == hdr.end() ? -1 : int(it - hdr.begin());
+    };
+    int ct = col("t_ms"), cm = col("temp"), cd = col("duty"), cf = col("fan"), cl = col("load");
+    if (ct < 0 || cm < 0 || (cd < 0 && cf < 0))
+        throw runtime_error("need t_ms, temp and duty or fan columns: " + path);
+
+    vector<trace_sample> v;
+    while (getline(f, line))
+    {
+        vector<string> r = split_csv(line);
+        if (int(r.size()) < int(hdr.size()) - 1)
+            continue;
+        auto num = [&](int c) { return c >= 0 && c < int(r.size()) && !r[c].empty() ? stod(r[c]) : NAN; };
+        double duty = cd >= 0 ? num(cd) / 100 : num(cf) > 0;
+        v.push_back({int64_t(num(ct)), num(cm) * 1000, duty, num(cl) / 100});
+    }
+    return v;
+}
+
+// minimises f over x from the start point with the given step per coordinate
+template <typename F>
+double nelder_mead(F f, vector<double>& x, const vector<double>& step, int max_evals)
+{
+    size_t n = x.size();
+    vector<vector<double>> p(n + 1, x);
+    vector<double> fx(n + 1);
+    for (size_t i = 0; i < n; i++)
+        p[i + 1][i] += step[i];
+    for (size_t i = 0; i <= n; i++)
+        fx[i] = f(p[i]);
+    int evals = int(n + 1);
+
+    vector<size_t> idx(n + 1);
+    while (evals < max_evals)
+    {
+        for (size_t i = 0; i <= n; i++)
+            idx[i] = i;
+        sort(idx.begin(), idx.end(), [&](size_t a, size_t b) { return fx[a] < fx[b]; });
+        size_t best = idx[0], worst = idx[n], second = idx[n - 1];
+        if (fx[worst] - fx[best] <= 1e-10 * (fabs(fx[best]) + 1e-12))
+            break;
+
+        vector<double> c(n, 0);
+        for (size_t i = 0; i <= n; i++)
+            if (i != worst)
+                for (size_t k = 0; k < n; k++)
+                    c[k] += p[i][k] / n;
+        auto along = [&](double a) {
+            vector<double> y(n);
+            for (size_t k = 0; k < n; k++)
+                y[k] = c[k] + a * (p[worst][k] - c[k]);
+            return y;
+        };
+
+        vector<double> r = along(-1);
+        double fr = f(r);
+        evals++;
+        if (fr < fx[best])
+        {
+            vector<double> e = along(-2);
+            double fe = f(e);
+            evals++;
+            p[worst] = fe < fr ? e : r;
+            fx[worst] = min(fe, fr);
+        }
+        else if (fr < fx[second])
+        {
+            p[worst] = r;
+            fx[worst] = fr;
+        }
+        else
+        {
+            vector<double> k = fr < fx[worst] ? along(-0.5) : along(0.5);
+            double fk = f(k);
+            evals++;
+            if (fk < min(fr, fx[worst]))
+            {
+                p[worst] = k;
+                fx[worst] = fk;
+            }
+            else
+            {
+                for (size_t i = 0; i <= n; i++)
+                    if (i != best)
+                    {
+                        for (size_t j = 0; j < n; j++)
+                            p[i][j] = p[best][j] + (p[i][j] - p[best][j]) / 2;
+                        fx[i] = f(p[i]);
+                        evals++;
+                    }
+            }
+        }
+    }
+    size_t best = min_element(fx.begin(), fx.end()) - fx.begin();
+    x = p[best];
+    return fx[best];
+}
+
+int main(int argc, char** argv)
+{
+    string hist_path = "/usr/local/etc/fanshim_history.bin", csv_path, out_path = "/usr/local/etc/fanshim_model.json";
+    double ambient = NAN;
+    bool dry = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string a = argv[i];
+        bool has_val = i + 1 < argc;
+        if (a == "-f" && has_val)
+            hist_path = argv[++i];
+        else if (a == "-c" && has_val)
+            csv_path = argv[++i];
+        else if (a == "-a" && has_val)
+            ambient = stod(argv[++i]) * 1000;
+        else if (a == "-o" && has_val)
+            out_path = argv[++i];
+        else if (a == "-n")
+            dry = true;
+        else
+        {
+            usage();
+            return a == "-h" ? 0 : 2;
+        }
+    }
+
+    try {
+        vector<trace_sample> v = csv_path.empty() ? read_history(hist_path) : read_csv(csv_path);
+
+        // a step is usable between two checks close enough in time; longer gaps (daemon stopped,
+        // clock set) restart the run from the measured temperature
+        vector<int64_t> dts;
+        for (size_t i = 1; i < v.size(); i++)
+            if (v[i].t_ms > v[i - 1].t_ms)
+                dts.push_back(v[i].t_ms - v[i - 1].t_ms);
+        if (dts.size() < 30)
+            throw runtime_error("not enough records to fit: " + to_string(v.size()));
+        nth_element(dts.begin(), dts.begin() + dts.size() / 2, dts.end());
+        const int64_t max_gap = min<int64_t>(dts[dts.size() / 2] * 5, 300000);
+
+        size_t n_on = 0, n_off = 0, n_load = 0, steps = 0, segments = 1;
+        double load_lo = 1, load_hi = 0, md_lo = 1e9;
+        for (size_t i = 0; i < v.size(); i++)
+        {
+            (v[i].duty > 0 ? n_on : n_off)++;
+            md_lo = min(md_lo, v[i].md);
+            if (!isnan(v[i].load))
+            {
+                n_load++;
+                load_lo = min(load_lo, v[i].load);
+                load_hi = max(load_hi, v[i].load);
+            }
+        }
+        // without any load recorded it counts as idle; the load term is then left at its default
+        const bool use_load = n_load * 2 > v.size();
+        for (trace_sample& s : v)
+            if (isnan(s.load))
+                s.load = use_load ? NAN : 0;
+
+        vector<char> cont(v.size(), 0);
+        for (size_t i = 1; i < v.size(); i++)
+        {
+            int64_t dt = v[i].t_ms - v[i - 1].t_ms;
+            cont[i] = dt > 0 && dt <= max_gap && !isnan(v[i].load);
+            steps += cont[i];
+            segments += !cont[i];
+        }
+
+        // what the records can tell apart
+        thermal_model m;
+        if (!isnan(ambient))
+            m.ambient_md = ambient;
+        else
+            m.ambient_md = min(m.ambient_md, md_lo - 10000);
+        const bool fit_ambient = isnan(ambient) && n_on > 0 && n_off > 0;
+        const bool fit_off = n_off > 0, fit_on = n_on > 0;
+        const bool fit_load = use_load && load_hi - load_lo >= 0.2;
+        if (!fit_on)
+            cout<<"the fan never ran: tau_on kept at "<<m.tau_on_s<<" s"<<endl;
+        if (!fit_off)
+            cout<<"the fan never stopped: tau_off kept at "<<m.tau_off_s<<" s"<<endl;
+        if (isnan(ambient) && !fit_ambient)
+            cout<<"ambient cannot be told from the idle rise without fan changes: kept at "<<fixed_str(llround(m.ambient_md), 3)<<", see -a"<<endl;
+        if (!fit_load)
+            cout<<(use_load ? "too little load variation" : "no load recorded")<<": load_rise kept at "<<fixed_str(llround(m.load_rise_md), 3)<<endl;
+
+        // free parameters: ambient and rises in millidegrees, time constants as logarithms
+        vector<double*> fields;
+        vector<double> x, step;
+        auto add = [&](bool on, double* field, double s) {
+            if (!on)
+                return;
+            fields.push_back(field);
+            x.push_back(*field);
+            step.push_back(s);
+        };
+        double log_off = log(m.tau_off_s), log_on = log(m.tau_on_s);
+        add(fit_ambient, &m.ambient_md, 3000);
+        add(fit_off, &log_off, 0.5);
+        add(fit_on, &log_on, 0.5);
+        add(true, &m.idle_rise_md, 3000);
+        add(fit_load, &m.load_rise_md, 5000);
+
+        auto apply = [&](const vector<double>& p) {
+            for (size_t k = 0; k < p.size(); k++)
+                *fields[k] = p[k];
+            m.tau_off_s = exp(log_off);
+            m.tau_on_s = exp(log_on);
+        };
+        // mean squared error of the free run, millidegrees^2
+        auto cost = [&](const vector<double>& p) {
+            apply(p);
+            // only physically sensible models, unmodelled heat would otherwise go anywhere
+            if (m.tau_off_s < 5 || m.tau_off_s > 1e5 || m.tau_on_s < 5 || m.tau_on_s > 1e5
+                || m.ambient_md < -20000 || m.ambient_md > 60000 || m.idle_rise_md < 0 || m.load_rise_md < 0)
+                return 1e18;
+            double md = v[0].md, sum = 0;
+            for (size_t i = 1; i < v.size(); i++)
+            {
+                if (!cont[i])
+                {
+                    md = v[i].md;
+                    continue;
+                }
+                md = m.step(md, v[i].load, v[i - 1].duty, (v[i].t_ms - v[i - 1].t_ms) / 1000.0);
+                double e = md - v[i].md;
+                sum += e * e;
+            }
+            return sum / steps;
+        };
+
+        double mse = 0;
+        for (int round = 0; round < 3; round++)
+            mse = nelder_mead(cost, x, step, 600 * int(x.size()));
+        apply(x);
+        if (!m.valid())
+            throw runtime_error("fit diverged");
+
+        double rms = sqrt(mse);
+        cout<<v.size()<<" records, "<<steps<<" steps in "<<segments<<" runs, "<<n_on * 100 / v.size()<<"% with the fan on"<<endl;
+        cout<<"ambient "<<fixed_str(llround(m.ambient_md), 3)<<", tau_off "<<fixed_str(llround(m.tau_off_s * 10), 1)
+            <<" s, tau_on "<<fixed_str(llround(m.tau_on_s * 10), 1)<<" s, idle_rise "<<fixed_str(llround(m.idle_rise_md), 3)
+            <<", load_rise "<<fixed_str(llround(m.load_rise_md), 3)<<endl;
+        cout<<"rms error "<<fixed_str(llround(rms), 3)<<(rms > 2000 ? ": poor fit, heat the model does not know about (load not recorded?)" : "")<<endl;
+        cout<<"settles: idle "<<fixed_str(llround(m.steady_md(0, 0)), 3)<<" / "<<fixed_str(llround(m.steady_md(0, 1)), 3)
+            <<", full load "<<fixed_str(llround(m.steady_md(1, 0)), 3)<<" / "<<fixed_str(llround(m.steady_md(1, 1)), 3)
+            <<" (fan off / on)"<<endl;
+
+        if (!dry && rms > 2000)
+            throw runtime_error("model not written");
+        if (!dry)
+        {
+            write_thermal_model(out_path, m, {{"rms", llround(rms) / 1000.0}, {"records", int64_t(v.size())}});
+            cout<<"written to "<<out_path<<endl;
+        }
+    } catch (exception &e) {
+        cout<<"fanshim_fit: "<<e.what()<<endl;
+        return 1;
+    }
+    return 0;
+}
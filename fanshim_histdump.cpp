@@ -0,0 +1,172 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include <chrono>
+
+#include <time.h>
+
+#include "fanshim_time.hpp"
+#include "fanshim_history.hpp"
+#include "fanshim_control.hpp"
+// clang++ fanshim_histdump.cpp -O2 -std=c++17 -o fanshim_histdump
+
+using namespace std;
+
+void usage()
+{
+    cout<<"fanshim_histdump [-f file] [-n last_n] [-s since_seconds] [-a above_celsius] [-c] [-q] [-F]\n"
+        <<"  -f  history file (default /usr/local/etc/fanshim_history.bin)\n"
+        <<"  -n  only the last n records\n"
+        <<"  -s  only records from the last s seconds\n"
+        <<"  -a  only records at or above this temperature\n"
+        <<"  -c  csv: t_ms,temp,fan,led,duty,load (percent, load empty when not recorded)\n"
+        <<"  -q  summary only\n"
+        <<"  -F  keep following new records\n";
+}
+
+string time_str(int64_t t_ms)
+{
+    time_t t = t_ms / 1000;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%F %T", &tm);
+    return buf;
+}
+
+struct history_summary
+{
+    uint64_t n = 0, fan_on = 0, fan_starts = 0, torn = 0;
+    int64_t first_ms = 0, last_ms = 0, max_ms = 0, sum_md = 0, sum_duty = 0;
+    int32_t min_md = 0, max_md = 0;
+    bool last_fan = false;
+
+    void add(const history_entry& e)
+    {
+        if (n == 0)
+        {
+            first_ms = e.t_ms;
+            min_md = max_md = e.md;
+            max_ms = e.t_ms;
+        }
+        else if (e.fan && !last_fan)
+            fan_starts++;
+        if (e.md < min_md)
+            min_md = e.md;
+        if (e.md > max_md)
+        {
+            max_md = e.md;
+            max_ms = e.t_ms;
+        }
+        sum_md += e.md;
+        fan_on += e.fan;
+        sum_duty += e.fan ? e.duty : 0;
+        last_fan = e.fan;
+        last_ms = e.t_ms;
+        n++;
+    }
+
+    void print() const
+    {
+        if (n == 0)
+        {
+            cout<<"no records"<<(torn ? " (" + to_string(torn) + " unreadable)" : "")<<endl;
+            return;
+        }
+        cout<<n<<" records, "<<time_str(first_ms)<<" .. "<<time_str(last_ms)<<endl;
+        cout<<"temp min "<<fixed_str(min_md, 3)<<" mean "<<fixed_str(sum_md / int64_t(n), 3)
+            <<" max "<<fixed_str(max_md, 3)<<" at "<<time_str(max_ms)<<endl;
+        cout<<"fan on "<<fixed_str(int64_t(fan_on * 1000 / n), 1)<<"% of records, mean duty "
+            <<fixed_str(sum_duty / int64_t(n), 1)<<"%, "<<fan_starts<<" starts"<<endl;
+        if (torn)
+            cout<<torn<<" records unreadable (being written or overwritten)"<<endl;
+    }
+};
+
+int main(int argc, char** argv)
+{
+    string path = "/usr/local/etc/fanshim_history.bin";
+    uint64_t last_n = 0;
+    int64_t since_s = -1;
+    int32_t above_md = INT32_MIN;
+    bool csv = false, quiet = false, follow = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string a = argv[i];
+        bool has_val = i + 1 < argc;
+        if (a == "-f" && has_val)
+            path = argv[++i];
+        else if (a == "-n" && has_val)
+            last_n = stoull(argv[++i]);
+        else if (a == "-s" && has_val)
+            since_s = stoll(argv[++i]);
+        else if (a == "-a" && has_val)
+            above_md = int32_t(stod(argv[++i]) * 1000);
+        else if (a == "-c")
+            csv = true;
+        else if (a == "-q")
+            quiet = true;
+        else if (a == "-F")
+            follow = true;
+        else
+        {
+            usage();
+            return a == "-h" ? 0 : 2;
+        }
+    }
+
+    try {
+        // read-only shared mapping: sees the daemon's writes as they happen, never blocks it
+        history_log log(path);
+        history_summary sum;
+
+        uint64_t end = log.count();
+        uint64_t i = log.first();
+        if (last_n > 0 && end - i > last_n)
+            i = end - last_n;
+        int64_t since_ms = since_s >= 0 ? realtime_ms() - since_s * 1000 : INT64_MIN;
+
+        if (csv && !quiet)
+            cout<<"t_ms,temp,fan,led,duty,load"<<endl;
+        while (true)
+        {
+            for (; i < end; i++)
+            {
+                history_entry e;
+                if (!log.get(i, e))
+                {
+                    sum.torn++;
+                    continue;
+                }
+                if (e.t_ms < since_ms || e.md < above_md)
+                    continue;
+                sum.add(e);
+                if (quiet)
+                    continue;
+                string load = e.load_pm >= 0 ? fixed_str(e.load_pm, 1) : "";
+                if (csv)
+                    cout<<e.t_ms<<","<<fixed_str(e.md, 3)<<","<<e.fan<<","<<e.led_level<<","<<e.duty / 10<<","<<load<<"\n";
+                else
+                    cout<<time_str(e.t_ms)<<"  "<<fixed_str(e.md, 3)<<"  "<<(e.fan ? "[on] " : "[off]")
+                        <<"  led "<<e.led_level<<(e.fan && e.duty < 1000 ? "  duty " + to_string(e.duty / 10) + "%" : "")
+                        <<(load.empty() ? "" : "  load " + load + "%")<<"\n";
+            }
+            cout.flush();
+            if (!follow)
+                break;
+            this_thread::sleep_for(chrono::seconds(1));
+            end = log.count();
+            // fell behind by more than the whole log
+            if (end - i > log.capacity())
+                i = end - log.capacity();
+        }
+
+        if (!csv || quiet)
+            sum.print();
+    } catch (exception &e) {
+        cout<<"fanshim_histdump: "<<e.what()<<endl;
+        return 1;
+    }
+    return 0;
+}
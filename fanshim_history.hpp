@@ -0,0 +1,251 @@
+#ifndef FANSHIM_HISTORY_HPP
+#define FANSHIM_HISTORY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fanshim_time.hpp"
+
+// A fixed-size circular log of (time, temperature, fan duty, cpu load, LED level), one record per
+// check, written in place through a shared mapping of the file: appending is a few stores, no syscall.
+// The page cache keeps everything written if the daemon dies; sync() (msync) every few minutes bounds
+// what a power cut can lose. Other processes can map the same file read-only and follow it while the
+// daemon runs.
+//
+// Layout: a 64 byte header, then `capacity` records. A record's seq is 0 while it is being written
+// and the low 32 bits of its index + 1 once complete, so a reader (or the daemon after a crash) can
+// tell torn or overwritten slots from good ones. Only 32-bit atomics: 64-bit ones are not lock-free
+// on armv6 (Pi Zero / Pi 1), so the 64-bit record count sits behind a 32-bit seqlock in the header.
+
+struct history_entry
+{
+    int64_t t_ms;           // wall clock, ms since the epoch
+    int32_t md;             // millidegrees
+    bool fan;
+    int led_level;          // 0 .. led_brightness_map::max_level
+    int duty = -1;          // permille, kept in percent steps; -1: full duty while on
+    int load_pm = -1;       // cpu utilisation since the previous check, -1: not read
+};
+
+class history_log
+{
+public:
+    static constexpr char magic[8] = "FSHIST1";
+    static constexpr uint32_t version = 3;
+
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+        uint64_t capacity;
+        std::atomic<uint32_t> count_seq;    // odd while count is being written
+        uint32_t pad0;
+        uint64_t count;                     // records ever appended, the next goes to count % capacity
+        char pad[24];
+    };
+
+    struct record
+    {
+        std::atomic<uint32_t> seq;
+        int32_t md;
+        int64_t t_ms;
+        uint8_t fan;            // duty in percent, 0: off
+        uint8_t led_level;
+        int16_t load_pm;        // -1: not read
+        uint32_t pad;
+    };
+
+    static_assert(sizeof(header) == 64, "header layout");
+    static_assert(sizeof(record) == 24, "record layout");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared between processes");
+
+    // writer: opens or creates path with room for capacity records; an existing log with the same
+    // capacity is continued, anything else is started over
+    history_log(const std::string& path, uint64_t capacity) : writable(true)
+    {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("open " + path + ": " + strerror(errno));
+        size_t size = sizeof(header) + capacity * sizeof(record);
+
+        struct stat st;
+        bool reuse = fstat(fd, &st) == 0 && size_t(st.st_size) == size;
+        if (!reuse && ftruncate(fd, 0) < 0)
+            fail("truncate " + path + ": " + strerror(errno));
+        if (ftruncate(fd, off_t(size)) < 0)
+            fail("resize " + path + ": " + strerror(errno));
+        map(size, PROT_READ | PROT_WRITE, path);
+
+        if (!reuse || !valid(capacity))
+        {
+            // a new file is zero filled by the resize, one in another format is cleared
+            if (reuse)
+                memset(base, 0, len);
+            memcpy(hdr->magic, magic, sizeof(magic));
+            hdr->version = version;
+            hdr->record_size = sizeof(record);
+            hdr->capacity = capacity;
+            hdr->count_seq.store(0);
+            hdr->count = 0;
+            sync();
+        }
+        else
+        {
+            // the last writer may have died half way through updating count: whatever count holds
+            // is a whole value (its records carry their own seq), only the seqlock needs evening up
+            uint32_t s = hdr->count_seq.load(std::memory_order_relaxed);
+            if (s & 1)
+                hdr->count_seq.store(s + 1, std::memory_order_release);
+        }
+        cap = capacity;
+    }
+
+    // reader: maps an existing log read-only
+    explicit history_log(const std::string& path) : writable(false)
+    {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("open " + path + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(header))
+            fail("not a history log: " + path);
+        map(size_t(st.st_size), PROT_READ, path);
+        cap = hdr->capacity;
+        if (!valid(cap) || sizeof(header) + cap * sizeof(record) != len)
+            fail("not a history log: " + path);
+    }
+
+    history_log(const history_log&) = delete;
+    history_log& operator=(const history_log&) = delete;
+
+    ~history_log()
+    {
+        if (writable)
+            sync();
+        munmap(base, len);
+        close(fd);
+    }
+
+    void append(const history_entry& e)
+    {
+        // the only writer: its own count needs no seqlock
+        uint64_t n = hdr->count;
+        record& r = recs[n % cap];
+        r.seq.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        r.t_ms = e.t_ms;
+        r.md = e.md;
+        // percent steps, but a running fan never rounds down to off
+        r.fan = !e.fan ? 0 : e.duty < 0 ? 100 : uint8_t(std::max((e.duty + 5) / 10, 1));
+        r.led_level = uint8_t(e.led_level);
+        r.load_pm = int16_t(e.load_pm);
+        r.seq.store(seq_of(n), std::memory_order_release);
+
+        uint32_t s = hdr->count_seq.load(std::memory_order_relaxed);
+        hdr->count_seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        hdr->count = n + 1;
+        hdr->count_seq.store(s + 2, std::memory_order_release);
+    }
+
+    // blocks until the mapping is on disk
+    void sync()
+    {
+        msync(base, len, MS_SYNC);
+    }
+
+    uint64_t capacity() const { return cap; }
+    uint64_t count() const
+    {
+        // the single writer never races itself
+        if (writable)
+            return hdr->count;
+        // a writer updates count in a few stores; one that stays odd this long died half way
+        // (until the daemon reopens the log), and then count no longer moves: take it as it is
+        uint64_t n = 0;
+        for (int tries = 0; tries < max_count_tries; tries++)
+        {
+            uint32_t s = hdr->count_seq.load(std::memory_order_acquire);
+            n = hdr->count;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!(s & 1) && hdr->count_seq.load(std::memory_order_relaxed) == s)
+                return n;
+            sched_yield();
+        }
+        return n;
+    }
+    // index of the oldest record still in the log
+    uint64_t first() const
+    {
+        uint64_t n = count();
+        return n > cap ? n - cap : 0;
+    }
+
+    // record number i (0 = first ever appended); false if it was overwritten, torn or not written yet
+    bool get(uint64_t i, history_entry& e) const
+    {
+        const record& r = recs[i % cap];
+        const uint32_t want = seq_of(i);
+        if (want == 0 || r.seq.load(std::memory_order_acquire) != want)
+            return false;
+        e.t_ms = r.t_ms;
+        e.md = r.md;
+        e.fan = r.fan != 0;
+        e.duty = r.fan * 10;
+        e.led_level = r.led_level;
+        e.load_pm = r.load_pm;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return r.seq.load(std::memory_order_relaxed) == want;
+    }
+
+private:
+    static constexpr int max_count_tries = 1000;
+    const bool writable;
+    int fd = -1;
+    void* base = nullptr;
+    size_t len = 0;
+    uint64_t cap = 0;
+    header* hdr = nullptr;
+    record* recs = nullptr;
+
+    // wraps every 2^32 records (1361 years at one a second); the one that wraps to 0 reads as torn
+    static uint32_t seq_of(uint64_t i) { return uint32_t(i + 1); }
+
+    void map(size_t size, int prot, const std::string& path)
+    {
+        base = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            fail("mmap " + path + ": " + strerror(errno));
+        len = size;
+        hdr = static_cast<header*>(base);
+        recs = reinterpret_cast<record*>(static_cast<char*>(base) + sizeof(header));
+    }
+
+    bool valid(uint64_t capacity) const
+    {
+        return memcmp(hdr->magic, magic, sizeof(magic)) == 0 && hdr->version == version
+            && hdr->record_size == sizeof(record) && hdr->capacity == capacity && capacity > 0;
+    }
+
+    [[noreturn]] void fail(const std::string& err)
+    {
+        if (base && base != MAP_FAILED)
+            munmap(base, len);
+        close(fd);
+        throw std::runtime_error(err);
+    }
+};
+
+#endif
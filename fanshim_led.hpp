@@ -0,0 +1,264 @@
+#ifndef FANSHIM_LED_HPP
+#define FANSHIM_LED_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// A 32 bit LED frame (<0xE0+brightness> <blue> <green> <red>), packed msb first
+constexpr uint32_t led_word(int br, int r, int g, int b)
+{
+    return (uint32_t(0b11100000 | br) << 24) | (uint32_t(b & 0xff) << 16) | (uint32_t(g & 0xff) << 8) | uint32_t(r & 0xff);
+}
+
+// hue: using 0 to 1/3 => red to green.
+constexpr double tmp2hue(double tmp, double hi, double lo)
+{
+    if (tmp < lo)
+        return 1.0/3.0;
+    else if (tmp > hi)
+        return 0.0;
+    else
+        return (hi-tmp)/(hi-lo)/3.0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+////https://en.wikipedia.org/wiki/HSL_and_HSV#HSV_to_RGB
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// fmod(n + hue/60, 6), constexpr: the argument is never negative
+constexpr double hsv_k(int n, double hue)
+{
+    double x = n + hue/60.0;
+    return x - 6 * double(int64_t(x / 6));
+}
+
+constexpr double hsv_f(int n, double hue,double s, double v)
+{
+    double k = hsv_k(n,hue);
+    return v - v * s * std::max( { std::min( {k, 4-k, 1.0} ), 0.0 } );
+}
+
+//// hsv: hue from temperature; s set to 1, v set to brightness like the official code https://github.com/pimoroni/fanshim-python/blob/5841386d252a80eeac4155e596d75ef01f86b1cf/examples/automatic.py#L44
+constexpr uint32_t led_color_word(double tmp, int br, double hi, double lo)
+{
+    double hue = tmp2hue(tmp, hi, lo) * 360;
+    double s = 1, v = br/31.0;
+    int r = int(hsv_f(5,hue, s, v)*255);
+    int g = int(hsv_f(3,hue, s, v)*255);
+    int b = int(hsv_f(1,hue, s, v)*255);
+    return led_word(br, r, g, b);
+}
+
+static_assert(led_color_word(40, 31, 60, 50) == led_word(31, 0, 255, 0), "green below off-threshold");
+static_assert(led_color_word(70, 31, 60, 50) == led_word(31, 255, 0, 0), "red above on-threshold");
+static_assert(led_color_word(55, 0, 60, 50) == led_word(0, 0, 0, 0), "dark at brightness 0");
+
+// Perceptual brightness levels => (5 bit global brightness, 8 bit channel PWM).
+// Scaling both the global field and the channels by the same brightness squares it and leaves only a
+// handful of distinct low levels; instead each level asks for luminance (l / max_level)^2 and gets the
+// (global, pwm) pair that comes closest, preferring the lowest global brightness (most PWM resolution)
+// among the pairs within 1%.
+// Level 4 * br looks like brightness br did with the double scaling, so configs keep their look.
+struct led_drive
+{
+    uint8_t global;
+    uint8_t pwm;
+};
+
+class led_brightness_map
+{
+public:
+    static constexpr int per_br = 4;
+    static constexpr int max_level = 31 * per_br;
+    static constexpr int levels = max_level + 1;
+
+    constexpr led_brightness_map() : drive()
+    {
+        for (int l = 1; l < levels; l++)
+        {
+            // target g * p, in units of one global step times one pwm step
+            double target = double(l) * l / (double(max_level) * max_level) * 31 * 255;
+            // lowest global brightness within 1% of the target, or the closest pair if none is
+            double tol = target / 100 > 0.5 ? target / 100 : 0.5;
+            double best_err = 1e9;
+            for (int g = 1; g <= 31; g++)
+            {
+                int p = int(target / g + 0.5);
+                p = p > 255 ? 255 : p;
+                double err = g * p - target;
+                err = err < 0 ? -err : err;
+                if (err < best_err)
+                {
+                    best_err = err;
+                    drive[l] = { uint8_t(g), uint8_t(p) };
+                }
+                if (err <= tol)
+                    break;
+            }
+        }
+    }
+
+    constexpr led_drive at(int level) const { return drive[level]; }
+
+    // a full-brightness LED word scaled to the level
+    constexpr uint32_t apply(uint32_t full, int level) const
+    {
+        led_drive d = drive[level];
+        auto ch = [&](int shift) { return int((((full >> shift) & 0xff) * d.pwm + 127) / 255); };
+        return led_word(d.global, ch(0), ch(8), ch(16));
+    }
+
+private:
+    led_drive drive[levels];
+};
+
+constexpr led_brightness_map led_brightness;
+
+static_assert(led_brightness.at(0).global == 0 && led_brightness.at(0).pwm == 0, "level 0 is dark");
+static_assert(led_brightness.at(led_brightness_map::max_level).global == 31 && led_brightness.at(led_brightness_map::max_level).pwm == 255, "top level is full on");
+
+// one stop of a temperature color palette, colors are linearly interpolated between stops
+struct led_color_stop
+{
+    double t;
+    uint8_t r, g, b;
+};
+
+// temperature (0.1 degree steps over the palette, or between off- and on-threshold for the default
+// red to green hue ramp) x brightness level => LED word, built once at config load from
+// led_color_word() or the palette and led_brightness; a single load per frame after that,
+// however many stops the palette has
+class led_color_table
+{
+public:
+    static constexpr int steps_per_degree = 10;
+    static constexpr int levels = led_brightness_map::levels;
+
+    // thresholds in millidegrees
+    void build(int32_t hi_md, int32_t lo_md)
+    {
+        const int md_per_step = 1000 / steps_per_degree;
+        int first_step = int(std::floor(double(lo_md) / md_per_step));
+        int last_step = int(std::ceil(double(hi_md) / md_per_step));
+        fill(first_step, last_step - first_step + 1, [&](double tmp) {
+            return led_color_word(tmp, 31, hi_md / 1000.0, lo_md / 1000.0);
+        });
+    }
+
+    // stops sorted by t; clamped to the first/last color outside them
+    void build(const std::vector<led_color_stop>& stops)
+    {
+        int lo = int(std::floor(stops.front().t * steps_per_degree));
+        int hi = int(std::ceil(stops.back().t * steps_per_degree));
+        size_t k = 0;
+        fill(lo, hi - lo + 1, [&](double tmp) {
+            while (k + 2 < stops.size() && tmp >= stops[k + 1].t)
+                k++;
+            const led_color_stop& a = stops[k];
+            const led_color_stop& b = stops[std::min(k + 1, stops.size() - 1)];
+            double u = b.t > a.t ? std::min(std::max((tmp - a.t) / (b.t - a.t), 0.0), 1.0) : 0.0;
+            auto mix = [&](uint8_t x, uint8_t y) { return int(std::lround(x + (y - x) * u)); };
+            return led_word(31, mix(a.r, b.r), mix(a.g, b.g), mix(a.b, b.b));
+        });
+    }
+
+    // temperature in millidegrees, level: 0 .. led_brightness_map::max_level
+    uint32_t lookup_md(int32_t md, int level) const
+    {
+        const int md_per_step = 1000 / steps_per_degree;
+        return at((md + (md >= 0 ? md_per_step / 2 : -md_per_step / 2)) / md_per_step, level);
+    }
+
+private:
+    std::vector<uint32_t> words;
+    int first = 0, n = 0;
+
+    // full(tmp): the full-brightness LED word at each step, in increasing temperature
+    template <typename F>
+    void fill(int first_step, int steps, F full)
+    {
+        first = first_step;
+        n = steps;
+        words.resize(size_t(n) * levels);
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t word = full(double(first + i) / steps_per_degree);
+            for (int l = 0; l < levels; l++)
+                words[size_t(i) * levels + l] = led_brightness.apply(word, l);
+        }
+    }
+
+    uint32_t at(int step, int level) const
+    {
+        int i = std::min(std::max(step - first, 0), n - 1);
+        return words[size_t(i) * levels + level];
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// keyframe animations: brightness over time, pre-rendered once into one brightness level per frame
+//////////////////////////////////////////////////////////////////////////////////////////
+
+enum class led_ease { linear, step, sine, exp };
+
+// level: 0..1 of the animation's max brightness, reached at t seconds;
+// ease shapes the segment leading up to this keyframe
+struct led_keyframe
+{
+    double t;
+    double level;
+    led_ease ease;
+};
+
+inline double led_ease_apply(led_ease ease, double u)
+{
+    switch (ease)
+    {
+        case led_ease::step:
+            return u < 1 ? 0 : 1;
+        case led_ease::sine:
+            return (1 - std::cos(M_PI * u)) / 2;
+        case led_ease::exp:
+            return u <= 0 ? 0 : (std::exp2(10 * u) - 1) / 1023;
+        default:
+            return u;
+    }
+}
+
+class led_animation
+{
+public:
+    // keys sorted by t, starting at t = 0; the last keyframe's t is the period.
+    // gamma > 1 makes evenly spaced levels look evenly spaced to the eye.
+    void render(const std::vector<led_keyframe>& keys, int max_level, double gamma, int fps)
+    {
+        double period = keys.back().t;
+        size_t n = std::max(long(1), std::lround(period * fps));
+        frames.assign(n, 0);
+        size_t k = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            double t = double(i) / fps;
+            while (k + 1 < keys.size() - 1 && t >= keys[k + 1].t)
+                k++;
+            double level = keys[k].level;
+            if (k + 1 < keys.size() && keys[k + 1].t > keys[k].t)
+            {
+                double u = std::min((t - keys[k].t) / (keys[k + 1].t - keys[k].t), 1.0);
+                level += (keys[k + 1].level - keys[k].level) * led_ease_apply(keys[k + 1].ease, u);
+            }
+            level = std::min(std::max(level, 0.0), 1.0);
+            frames[i] = uint8_t(std::lround(max_level * std::pow(level, gamma)));
+        }
+    }
+
+    uint8_t level(uint64_t frame) const { return frames[frame % frames.size()]; }
+    size_t size() const { return frames.size(); }
+
+private:
+    std::vector<uint8_t> frames;
+};
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef FANSHIM_LED_BUS_HPP
+#define FANSHIM_LED_BUS_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+#include <unistd.h>
+
+const int led_clck_pin = 14;
+const int led_dat_pin = 15;
+
+const int LOW = 0;
+const int HIGH =1;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//https://github.com/pimoroni/fanshim-python/issues/19#issuecomment-517478717
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// syscalls issued by the led writers (gpio set_value/set_values ioctls, spidev writes)
+inline unsigned long led_syscalls = 0;
+
+class led_bus
+{
+public:
+    virtual ~led_bus() {}
+    virtual const char* name() const = 0;
+    virtual void write_frame(uint32_t word) = 0;
+};
+
+// one ioctl per edge: clock and data requested as separate lines.
+// Line: gpiod::line, or anything with a set_value(int) (the benchmark's simulated lines)
+template <typename Line>
+class led_bus_lines : public led_bus
+{
+public:
+    led_bus_lines(Line clk, Line dat) : clk(clk), dat(dat) {}
+
+    const char* name() const { return "lines"; }
+
+    void write_frame(uint32_t word)
+    {
+        //start frame
+        set_dat(LOW);
+        for (int i = 0; i < 32; ++i)
+        {
+            set_clk(HIGH);
+            set_clk(LOW);
+        }
+        
+        write_byte(word >> 24); // 0xE0 | br, in range of 0..31 for the fanshim
+        write_byte(word >> 16); // b
+        write_byte(word >> 8);  // g
+        write_byte(word);       // r
+        
+        // An end frame consisting of at least (n/2) bits of 1, where n is the number of LEDs in the string
+        set_dat(HIGH);
+        for (int i = 0; i < 1; ++i)
+        {
+            set_clk(HIGH);
+            set_clk(LOW);
+        }
+    }
+
+private:
+    Line clk, dat;
+
+    inline void set_clk(int v) { clk.set_value(v); led_syscalls++; }
+    inline void set_dat(int v) { dat.set_value(v); led_syscalls++; }
+
+    inline void write_byte(uint8_t byte)
+    {
+        for (int n = 0; n < 8; n++)
+        {
+            set_dat((byte & (1 << (7 - n))) > 0);
+            set_clk(HIGH);
+            // nano_usleep_frac(CLCK_STRETCH);
+            set_clk(LOW);
+            // nano_usleep_frac(CLCK_STRETCH);
+        }
+    }
+};
+
+// start frame 32 + led frame 32 + end frame 1 clocks, two states each, plus the final falling edge
+const int led_max_states = 2 * (32 + 32 + 1) + 1;
+
+// pre-render a whole frame into combined {clk, dat} line states (bit 0: clk, bit 1: dat),
+// dropping states identical to the previous one.
+// Data changes together with the falling clock edge (the APA102 samples on the rising one),
+// so a bit is two states instead of three separate line writes.
+inline int led_render_states(uint32_t word, uint8_t* states)
+{
+    int n = 0;
+    auto push = [&](int clk, int dat) {
+        uint8_t st = uint8_t(clk | (dat << 1));
+        if (n == 0 || states[n - 1] != st)
+            states[n++] = st;
+    };
+    auto clock_bit = [&](int dat) {
+        push(LOW, dat);
+        push(HIGH, dat);
+    };
+
+    for (int i = 0; i < 32; i++)
+        clock_bit(LOW);
+    for (int i = 31; i >= 0; i--)
+        clock_bit((word >> i) & 1);
+    clock_bit(HIGH);
+    push(LOW, HIGH);
+    return n;
+}
+
+// clock and data requested together as one line_bulk, a single set_values() ioctl per state.
+// Bulk: gpiod::line_bulk, or anything with a set_values(const std::vector<int>&)
+template <typename Bulk>
+class led_bus_bulk : public led_bus
+{
+public:
+    led_bus_bulk(Bulk lines) : lines(lines)
+    {
+        // in the order the lines were requested: {clk, dat}
+        for (int st = 0; st < 4; st++)
+            vals[st] = { st & 1, (st >> 1) & 1 };
+    }
+
+    const char* name() const { return "bulk"; }
+
+    void write_frame(uint32_t word)
+    {
+        int n = led_render_states(word, states);
+        for (int i = 0; i < n; i++)
+            lines.set_values(vals[states[i]]);
+        led_syscalls += n;
+    }
+
+private:
+    Bulk lines;
+    std::vector<int> vals[4];
+    uint8_t states[led_max_states];
+};
+
+// BCM283x gpio register block, mmap'd from /dev/gpiomem: pins are toggled with plain stores
+// to the set/clear registers, no syscall per edge.
+// The base pointer is injectable so any 4 KiB of writable memory can stand in for the hardware.
+class led_bus_gpiomem : public led_bus
+{
+public:
+    // register word offsets
+    static constexpr int GPFSEL0 = 0;
+    static constexpr int GPSET0 = 7;
+    static constexpr int GPCLR0 = 10;
+    static constexpr size_t block_size = 4096;
+
+    led_bus_gpiomem(volatile uint32_t* base) : base(base)
+    {
+        set_output(led_clck_pin);
+        set_output(led_dat_pin);
+    }
+
+    const char* name() const { return "gpiomem"; }
+
+    static volatile uint32_t* map(const char* path = "/dev/gpiomem")
+    {
+        int fd = open(path, O_RDWR | O_SYNC);
+        if (fd < 0)
+            throw std::runtime_error(std::string("open ") + path + ": " + strerror(errno));
+        void* p = mmap(nullptr, block_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error(std::string("mmap ") + path + ": " + strerror(errno));
+        return static_cast<volatile uint32_t*>(p);
+    }
+
+    void write_frame(uint32_t word)
+    {
+        const uint32_t mask[2] = { 1u << led_clck_pin, 1u << led_dat_pin };
+        int n = led_render_states(word, states);
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t on = ((states[i] & 1) ? mask[0] : 0) | ((states[i] & 2) ? mask[1] : 0);
+            uint32_t off = (mask[0] | mask[1]) & ~on;
+            // clear first so a falling clock never overlaps the next data bit
+            if (off)
+                base[GPCLR0] = off;
+            if (on)
+                base[GPSET0] = on;
+        }
+    }
+
+private:
+    volatile uint32_t* base;
+    uint8_t states[led_max_states];
+
+    void set_output(int pin)
+    {
+        volatile uint32_t* fsel = base + GPFSEL0 + pin / 10;
+        int shift = (pin % 10) * 3;
+        *fsel = (*fsel & ~(7u << shift)) | (1u << shift);
+    }
+};
+
+// the APA102 protocol as plain bytes: 4 byte start frame, the led frame, 1 byte end frame
+const int led_frame_len = 9;
+
+inline void led_frame_bytes(uint32_t word, uint8_t* buf)
+{
+    buf[0] = buf[1] = buf[2] = buf[3] = 0;
+    buf[4] = uint8_t(word >> 24);
+    buf[5] = uint8_t(word >> 16);
+    buf[6] = uint8_t(word >> 8);
+    buf[7] = uint8_t(word);
+    buf[8] = 0xff;
+}
+
+// The whole frame in one write() to a byte sink: a spidev device
+// (pins 14/15 are not the hardware SPI pins, so this needs a spi-gpio overlay on them),
+// or a plain file or pipe standing in for it.
+class led_bus_spi : public led_bus
+{
+public:
+    unsigned long write_errors = 0;
+
+    led_bus_spi(int fd) : fd(fd) {}
+    led_bus_spi(const led_bus_spi&) = delete;
+    led_bus_spi& operator=(const led_bus_spi&) = delete;
+    ~led_bus_spi() { close(fd); }
+
+    const char* name() const { return "spidev"; }
+
+    // the SPI mode/speed ioctls are skipped when the path is not a spidev (ENOTTY); a spidev that
+    // rejects the mode or the speed is an error, the LED would not work with it
+    static int open_sink(const std::string& path, uint32_t speed_hz = 1000000)
+    {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error("open " + path + ": " + strerror(errno));
+
+        uint8_t mode = SPI_MODE_0;
+        if (ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0 || ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)
+        {
+            if (errno != ENOTTY)
+            {
+                std::string err = strerror(errno);
+                close(fd);
+                throw std::runtime_error("spi setup " + path + ": " + err);
+            }
+        }
+        return fd;
+    }
+
+    void write_frame(uint32_t word)
+    {
+        led_frame_bytes(word, buf);
+        if (write(fd, buf, led_frame_len) != led_frame_len)
+            write_errors++;
+        led_syscalls++;
+    }
+
+private:
+    int fd;
+    uint8_t buf[led_frame_len];
+};
+
+#endif
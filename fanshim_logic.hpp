@@ -0,0 +1,245 @@
+#ifndef FANSHIM_LOGIC_HPP
+#define FANSHIM_LOGIC_HPP
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include "fanshim_control.hpp"
+#include "fanshim_fan.hpp"
+#include "fanshim_model.hpp"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// the fan decision of one check, shared by the daemon and the simulator
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// "pid" config object; gains in permille per degree and seconds
+struct fan_pid_conf
+{
+    bool on = false;
+    int32_t setpoint_md = 55000;
+    pid_gains gains;
+    double d_div = 8;
+    bool autotune = false;
+    int relay_low = 0, relay_high = 1000;
+    int32_t hyst_md = 500;
+    int cycles = 3;
+};
+
+// "mpc" config object; levels in permille
+struct fan_mpc_conf
+{
+    bool on = false;
+    int horizon = 6;
+    std::vector<int> levels;
+    mpc_weights weights;
+};
+
+struct fan_logic_conf
+{
+    int32_t on_md = 60000, off_md = 50000;
+    int budget = 3;
+    int64_t delay_ms = 10000;
+    // budget in time rather than samples: (budget - 1) * delay
+    bool adaptive = false;
+    bool predict = false;
+    int predict_window = 6, predict_order = 1;
+    int64_t predict_horizon_ms = 30000;
+    int load_on = 0, psi_on = 0, load_budget = 3;     // percent, 0: off
+    int failsafe = 1;                                   // 1: on, 0: off, 2: leave as is
+    fan_curve curve;                                    // no points: on/off at full duty
+    fan_pid_conf pid;
+    fan_mpc_conf mpc;
+    thermal_model model;                                // what mpc plans with
+};
+
+struct fan_inputs
+{
+    int64_t t_ms;
+    int32_t md;
+    int duty;                   // what the fan runs at now
+    int32_t load_pm = -1;       // cpu utilisation, -1: not read
+    int32_t psi_x100 = -1;      // cpu pressure some avg10, -1: not read
+    bool stale = false;         // no usable temperature for a while
+    bool override_on = false;   // the override file exists
+};
+
+// Thresholds with the budget (over the last budget samples, or over time when adaptive), then the
+// load feed-forward and the predictor can start the fan early, the fail-safe and the override file
+// force it; with pid or mpc the duty comes from the controller instead of the thresholds and the curve.
+// log: the same lines the daemon always printed, nullptr to run silently
+class fan_logic
+{
+public:
+    bool all_low = false, all_high = false;
+    bool failsafe = false, forced = false;
+    bool switched_on = false;           // the last decision started the fan
+    bool have_prediction = false;
+    int32_t predicted_md = 0;
+
+    explicit fan_logic(const fan_logic_conf& c, std::ostream* log = nullptr)
+        : c(c), log(log), tmp_q(c.budget, c.on_md, c.off_md), timed_hyst((c.budget - 1) * c.delay_ms),
+          predictor(c.predict_window, c.predict_order, c.predict_horizon_ms), pid_on(c.pid.on)
+    {
+        if (pid_on && c.pid.autotune)
+            tuner.reset(new relay_autotune(c.pid.setpoint_md, c.pid.hyst_md, c.pid.relay_low, c.pid.relay_high, c.pid.cycles));
+        else if (pid_on)
+            pid.reset(new pid_controller(c.pid.gains, c.pid.d_div));
+        if (c.mpc.on)
+            mpc.reset(new mpc_controller(c.model, c.mpc.levels, c.mpc.horizon, c.delay_ms, c.on_md, c.mpc.weights));
+    }
+
+    // the duty (permille) the fan should run at
+    int decide(const fan_inputs& in)
+    {
+        tmp_q.push(in.md);
+        if (log)
+        {
+            *log<<"Temp: "<<fixed_str(in.md, 3)<<", last "<<c.budget<<": [ ";
+            for (int j = 0; j < tmp_q.size(); j++)
+                *log<<fixed_str(tmp_q.at(j), 3)<<" ";
+            *log<<"]\n";
+        }
+
+        if (c.adaptive)
+        {
+            timed_hyst.add(in.t_ms, in.md > c.on_md, in.md < c.off_md);
+            all_low = timed_hyst.all_low();
+            all_high = timed_hyst.all_high();
+        }
+        else
+        {
+            all_low = tmp_q.all_low();
+            all_high = tmp_q.all_high();
+        }
+
+        if (c.load_on > 0 || c.psi_on > 0)
+        {
+            bool busy = (c.load_on > 0 && in.load_pm >= 0 && in.load_pm >= c.load_on * 10)
+                || (c.psi_on > 0 && in.psi_x100 >= 0 && in.psi_x100 >= c.psi_on * 100);
+            load_streak = busy ? load_streak + 1 : 0;
+            if (load_streak >= c.load_budget && !all_high)
+            {
+                all_high = true;
+                all_low = false;
+                if (log)
+                    *log<<"sustained cpu load "<<fixed_str(in.load_pm, 1)<<"%: starting fan early"<<std::endl;
+            }
+        }
+
+        if (c.predict)
+        {
+            have_prediction = predictor.add(in.t_ms, in.md, predicted_md);
+            if (have_prediction && !all_high && predictor.is_rising() && predictor.peak_md() > c.on_md)
+            {
+                all_high = true;
+                all_low = false;
+                if (log)
+                    *log<<"predicted "<<fixed_str(predictor.peak_md(), 3)<<" within "<<c.predict_horizon_ms / 1000<<" s: starting fan early"<<std::endl;
+            }
+        }
+
+        if (log)
+            *log<<"all low: "<<std::boolalpha<<all_low<<"; all high: "<<all_high<<std::endl;
+
+        forced = false;
+        failsafe = in.stale;
+        if (failsafe)
+        {
+            all_high = c.failsafe == 1;
+            all_low = c.failsafe == 0;
+            forced = all_high;
+            if (log)
+                *log<<"temperature stale: fail-safe, fan "<<(all_high ? "on" : all_low ? "off" : "unchanged")<<std::endl;
+        }
+
+        if (in.override_on)
+        {
+            all_high = true;
+            all_low = false;
+            forced = true;
+            if (log)
+                *log<<"forcing fan on: override effective."<<std::endl;
+        }
+
+        bool was_on = in.duty > 0;
+        int duty;
+        if (mpc && !forced && !failsafe)
+        {
+            // unknown load: planned as idle
+            duty = mpc->update(in.md, in.load_pm >= 0 ? in.load_pm / 1000.0 : 0, in.duty);
+            if (log)
+                *log<<"mpc: duty "<<fixed_str(duty, 1)<<"%, predicted peak "<<fixed_str(llround(mpc->peak_md()), 3)
+                    <<", cost "<<mpc->cost()<<" ("<<mpc->evaluated()<<" steps evaluated)"<<std::endl;
+        }
+        else if (pid_on && !forced && !failsafe)
+        {
+            duty = pid_duty(in);
+            // under min_duty the fan would stall: off below half of it, min_duty up to it
+            if (duty < c.curve.min_permille)
+                duty = duty * 2 < c.curve.min_permille ? 0 : c.curve.min_permille;
+        }
+        else
+        {
+            bool on = was_on;
+            if (all_high && !was_on)
+                on = true;
+            else if (all_low && was_on)
+                on = false;
+            // speed from the curve while running (always full for the on/off switch), full when forced on
+            duty = !on ? 0 : forced ? 1000 : c.curve.duty(in.md);
+            if (pid)
+                pid->reset(duty);
+        }
+        switched_on = duty > 0 && !was_on;
+        return duty;
+    }
+
+    const temp_window& window() const { return tmp_q; }
+    const trend_predictor& trend() const { return predictor; }
+    bool pid_mode() const { return pid_on; }
+    bool tuning() const { return bool(tuner); }
+    const mpc_controller* planner() const { return mpc.get(); }
+
+private:
+    const fan_logic_conf c;
+    std::ostream* log;
+    temp_window tmp_q;
+    timed_hysteresis timed_hyst;
+    trend_predictor predictor;
+    int load_streak = 0;
+
+    bool pid_on;
+    std::unique_ptr<relay_autotune> tuner;
+    std::unique_ptr<pid_controller> pid;
+    std::unique_ptr<mpc_controller> mpc;
+
+    int pid_duty(const fan_inputs& in)
+    {
+        if (!tuner)
+            return pid->update(in.t_ms, c.pid.setpoint_md, in.md);
+
+        int duty = tuner->update(in.t_ms, in.md);
+        if (tuner->done() || tuner->failed())
+        {
+            pid_gains g = tuner->done() ? tuner->gains() : c.pid.gains;
+            if (log && tuner->done())
+                *log<<"pid autotune: tu "<<tuner->tu_s()<<" s, amplitude "<<tuner->amplitude()<<", ku "<<tuner->ku() / 10
+                    <<" => kp "<<g.kp / 10<<" ti "<<g.ti<<" td "<<g.td<<std::endl;
+            else if (log)
+                *log<<"pid autotune failed, no limit cycle"<<(g.kp > 0 ? ", using the configured gains" : ", using the thresholds")<<std::endl;
+            if (g.kp > 0)
+            {
+                pid.reset(new pid_controller(g, c.pid.d_div));
+                pid->reset(duty);
+            }
+            else
+                pid_on = false;
+            tuner.reset();
+        }
+        return duty;
+    }
+};
+
+#endif
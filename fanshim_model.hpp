@@ -0,0 +1,171 @@
+#ifndef FANSHIM_MODEL_HPP
+#define FANSHIM_MODEL_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// first-order (single RC) thermal model of the SoC with the fan
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// dT/dt = heat(load) - conductance(duty) * (T - ambient)
+//   conductance(duty) = (1 - duty) / tau_off + duty / tau_on     (1/s, duty 0..1)
+//   heat(load) = (idle_rise + load * load_rise) / tau_off         (millidegrees/s, load 0..1)
+// so with the fan off the SoC settles idle_rise + load * load_rise above ambient, with time
+// constant tau_off; with the fan at full duty the same heat settles tau_on / tau_off as high.
+struct thermal_model
+{
+    double ambient_md = 30000;
+    double tau_off_s = 240;
+    double tau_on_s = 80;
+    double idle_rise_md = 18000;
+    double load_rise_md = 32000;
+
+    double conductance(double duty) const { return (1 - duty) / tau_off_s + duty / tau_on_s; }
+    double heat(double load) const { return (idle_rise_md + load * load_rise_md) / tau_off_s; }
+
+    // where the temperature settles with these inputs held
+    double steady_md(double load, double duty) const { return ambient_md + heat(load) / conductance(duty); }
+
+    // exact solution over dt_s with load and duty held
+    double step(double md, double load, double duty, double dt_s) const
+    {
+        double ss = steady_md(load, duty);
+        return ss + (md - ss) * std::exp(-conductance(duty) * dt_s);
+    }
+
+    bool valid() const
+    {
+        return tau_off_s > 0 && tau_on_s > 0 && std::isfinite(ambient_md) && std::isfinite(idle_rise_md)
+            && std::isfinite(load_rise_md);
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// model-predictive fan schedule
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// degrees of the predicted peak over the limit, minutes above it, fan starts and stops, and the
+// fan duty summed over the steps (0..1 each, noise and wear) per horizon
+struct mpc_weights
+{
+    double peak = 10;
+    double above = 10;
+    double switches = 2;
+    double duty = 3;
+};
+
+// Every check, all schedules of the duty levels over the next horizon steps are scored against the
+// model (load held at its current value, starting from the measured temperature) and the first step
+// of the cheapest one is applied. Past the horizon the last level is held for as long again, so a
+// schedule that switches off just before a rise does not look free.
+// The search is exhaustive but depth first with the cost so far as the bound: every term only grows
+// along a schedule, so branches already dearer than the best complete schedule are cut, and the
+// current level is tried first to find a good bound early. A step is one multiply-add; the
+// exponentials depend only on the level and step length and are computed once.
+class mpc_controller
+{
+public:
+    static constexpr int max_levels = 8, max_horizon = 12;
+
+    // levels: duty in permille, 0 first; step_ms: time between checks
+    mpc_controller(const thermal_model& m, const std::vector<int>& levels, int horizon, int64_t step_ms,
+                   int32_t limit_md, const mpc_weights& w)
+        : m(m), n_levels(std::min(int(levels.size()), int(max_levels))), horizon(std::min(std::max(horizon, 1), int(max_horizon))),
+          limit(limit_md), w(w)
+    {
+        double dt = step_ms / 1000.0;
+        step_min = dt / 60;
+        for (int l = 0; l < n_levels; l++)
+        {
+            level[l] = levels[l];
+            a[l] = std::exp(-m.conductance(levels[l] / 1000.0) * dt);
+            a_tail[l] = std::exp(-m.conductance(levels[l] / 1000.0) * dt * this->horizon);
+        }
+    }
+
+    // md: measured now, load 0..1 over the horizon, duty: what the fan runs at now
+    int update(int32_t md, double load, int duty)
+    {
+        for (int l = 0; l < n_levels; l++)
+            ss[l] = m.steady_md(load, level[l] / 1000.0);
+        int cur = 0;
+        for (int l = 1; l < n_levels; l++)
+            if (std::abs(level[l] - duty) < std::abs(level[cur] - duty))
+                cur = l;
+        order[0] = cur;
+        for (int l = 0, k = 1; l < n_levels; l++)
+            if (l != cur)
+                order[k++] = l;
+
+        best = 1e300;
+        nodes = 0;
+        search(0, md, duty > 0, -1e300, 0, 0, 0);
+        return level[best_first];
+    }
+
+    // of the last update: the chosen schedule's cost and predicted peak, schedule steps evaluated
+    double cost() const { return best; }
+    double peak_md() const { return best_peak; }
+    unsigned long evaluated() const { return nodes; }
+    int steps() const { return horizon; }
+
+private:
+    const thermal_model m;
+    const int n_levels, horizon;
+    const int32_t limit;
+    const mpc_weights w;
+    double step_min;
+    int level[max_levels];
+    double a[max_levels], a_tail[max_levels], ss[max_levels];
+    int order[max_levels];
+
+    double best = 0, best_peak = 0;
+    int best_first = 0, first = 0;
+    unsigned long nodes = 0;
+
+    double score(double peak, double above_min, int switches, double duty_sum) const
+    {
+        return w.peak * std::max(0.0, (peak - limit) / 1000) + w.above * above_min + w.switches * switches
+            + w.duty * duty_sum / horizon;
+    }
+
+    void search(int depth, double md, bool on, double peak, double above_min, int switches, double duty_sum)
+    {
+        for (int k = 0; k < n_levels; k++)
+        {
+            int l = order[k];
+            if (depth == 0)
+                first = l;
+            nodes++;
+            double t = ss[l] + (md - ss[l]) * a[l];
+            double pk = std::max(peak, t);
+            double ab = above_min + (t > limit ? step_min : 0);
+            int sw = switches + ((level[l] > 0) != on);
+            double du = duty_sum + level[l] / 1000.0;
+            if (score(pk, ab, sw, du) >= best)
+                continue;
+            if (depth + 1 < horizon)
+            {
+                search(depth + 1, t, level[l] > 0, pk, ab, sw, du);
+                continue;
+            }
+            // held past the horizon for as long again
+            double tail = ss[l] + (t - ss[l]) * a_tail[l];
+            pk = std::max(pk, tail);
+            ab += tail > limit ? step_min * horizon : 0;
+            du += level[l] / 1000.0 * horizon;
+            double c = score(pk, ab, sw, du);
+            if (c < best)
+            {
+                best = c;
+                best_peak = pk;
+                best_first = first;
+            }
+        }
+    }
+};
+
+#endif
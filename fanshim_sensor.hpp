@@ -0,0 +1,568 @@
+#ifndef FANSHIM_SENSOR_HPP
+#define FANSHIM_SENSOR_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fanshim_time.hpp"
+
+// "45123\n" => 45123; optional sign, digits up to the first newline/NUL, nothing else allowed.
+// Returns 0, or -EINVAL if the buffer is not a millidegree value.
+inline int parse_millideg(const char* buf, size_t n, int32_t& md)
+{
+    size_t i = 0;
+    bool neg = false;
+    if (i < n && (buf[i] == '-' || buf[i] == '+'))
+        neg = buf[i++] == '-';
+
+    int64_t v = 0;
+    size_t digits = 0;
+    for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++, digits++)
+    {
+        v = v * 10 + (buf[i] - '0');
+        if (v > INT32_MAX)
+            return -EINVAL;
+    }
+    if (digits == 0 || (i < n && buf[i] != '\n' && buf[i] != '\0'))
+        return -EINVAL;
+
+    md = int32_t(neg ? -v : v);
+    return 0;
+}
+
+// A sysfs temperature file (millidegrees) kept open as a raw fd: every sample is one pread() at
+// offset 0 into a stack buffer and parse_millideg(), no stream state that can get stuck and no allocation.
+class sysfs_temp_reader
+{
+public:
+    unsigned long syscalls = 0;
+
+    explicit sysfs_temp_reader(const std::string& path) : path(path)
+    {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        open_errno = fd < 0 ? errno : 0;
+    }
+
+    // after errors: the zone may have gone away and come back (driver rebind, hotplug)
+    void reopen()
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        open_errno = fd < 0 ? errno : 0;
+    }
+
+    ~sysfs_temp_reader()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    sysfs_temp_reader(const sysfs_temp_reader&) = delete;
+    sysfs_temp_reader& operator=(const sysfs_temp_reader&) = delete;
+
+    // 0 and md set, or a negative errno (-EINVAL: unparsable, -ENODATA: empty read)
+    int read(int32_t& md)
+    {
+        if (fd < 0)
+            return -open_errno;
+
+        char buf[24];
+        ssize_t n = pread(fd, buf, sizeof(buf), 0);
+        syscalls++;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            return -ENODATA;
+        return parse_millideg(buf, size_t(n), md);
+    }
+
+    const std::string& source() const { return path; }
+
+private:
+    std::string path;
+    int fd;
+    int open_errno;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// every thermal zone and hwmon temperature input, reduced to the one value the loop works on
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// per-source read health, exported as metrics
+struct sensor_health
+{
+    unsigned long reads = 0, errors = 0, slow = 0, reopens = 0;
+    int64_t last_us = 0, max_us = 0;    // read latency
+    int32_t same_md = 0;
+    int64_t same_since_ms = -1;         // reading the same value since
+    bool stuck = false;
+    int64_t backoff_ms = 0, retry_ms = 0;   // after errors: reopen at retry_ms, backoff doubling up to a limit
+};
+
+struct sensor_health_limits
+{
+    static constexpr int64_t backoff_min_ms = 1000, backoff_max_ms = 64000;
+    int64_t slow_us = 50000;        // a read taking longer is counted as slow
+    int64_t stuck_ms = 900000;      // the exact same value for this long: stuck sensor, 0: never
+    int64_t stale_ms = 60000;       // no usable reading from any source for this long: stale
+};
+
+struct temp_source
+{
+    std::string name;       // thermal zone type / hwmon name, e.g. "cpu-thermal", "cpu_thermal/temp1"
+    std::string id;         // path below the sysfs class dir, e.g. "thermal_zone0", "hwmon0/temp1_input"
+    std::unique_ptr<sysfs_temp_reader> reader;
+    int weight = 1;
+    int32_t on_md = 0, off_md = 0;  // per-zone thresholds, 0/0: the global ones
+    int32_t last_md = 0;
+    int err = 0;            // of the last read, -EAGAIN while waiting to reopen, -ESTALE while stuck
+    sensor_health health;
+};
+
+// max: hottest source; mean: weighted mean; threshold: each source is rescaled from its own
+// off/on thresholds onto the global ones, then the hottest wins
+enum class temp_policy { max, mean, threshold };
+
+class temp_sensor_set
+{
+public:
+    std::vector<temp_source> sources;
+    temp_policy policy = temp_policy::max;
+    sensor_health_limits limits;
+
+    // sysfs_root: "/sys", or a directory tree laid out like it standing in for tests
+    void discover(const std::string& sysfs_root = "/sys")
+    {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        std::vector<fs::path> found;
+
+        for (auto& d : fs::directory_iterator(fs::path(sysfs_root) / "class/thermal", ec))
+            if (d.path().filename().string().rfind("thermal_zone", 0) == 0 && fs::exists(d.path() / "temp", ec))
+                found.push_back(d.path() / "temp");
+
+        for (auto& d : fs::directory_iterator(fs::path(sysfs_root) / "class/hwmon", ec))
+            for (auto& f : fs::directory_iterator(d.path(), ec))
+            {
+                std::string fn = f.path().filename().string();
+                if (fn.rfind("temp", 0) == 0 && fn.size() > 10 && fn.compare(fn.size() - 6, 6, "_input") == 0)
+                    found.push_back(f.path());
+            }
+
+        std::sort(found.begin(), found.end());
+        for (auto& p : found)
+        {
+            temp_source src;
+            bool hwmon = p.filename() != "temp";
+            fs::path dir = p.parent_path();
+            src.id = hwmon ? (dir.filename() / p.filename()).string() : dir.filename().string();
+            src.name = first_line(dir / (hwmon ? "name" : "type"));
+            if (src.name.empty())
+                src.name = src.id;
+            else if (hwmon)
+                src.name += "/" + p.filename().string().substr(0, p.filename().string().size() - 6);
+            src.reader.reset(new sysfs_temp_reader(p.string()));
+            sources.push_back(std::move(src));
+        }
+    }
+
+    // a single file, e.g. when nothing was discovered
+    void add(const std::string& path)
+    {
+        temp_source src;
+        src.name = src.id = path;
+        src.reader.reset(new sysfs_temp_reader(path));
+        sources.push_back(std::move(src));
+    }
+
+    temp_source* find(const std::string& name_or_id)
+    {
+        for (auto& src : sources)
+            if (src.name == name_or_id || src.id == name_or_id)
+                return &src;
+        return nullptr;
+    }
+
+    // reads every source once, back to back in the same wakeup, and aggregates the ones that read fine.
+    // 0 and md set, or the first source's negative errno when none could be read.
+    // Failing sources are reopened with backoff, stuck ones left out until their value moves again.
+    int read(int32_t& md, int32_t on_md = 0, int32_t off_md = 0)
+    {
+        int first_err = -ENOENT;
+        bool any = false;
+        int64_t sum = 0, wsum = 0;
+        int32_t agg = INT32_MIN;
+        int64_t t_us = monotonic_us(), t_ms = t_us / 1000;
+        if (first_ms < 0)
+            first_ms = t_ms;
+
+        for (auto& src : sources)
+        {
+            src.err = read_source(src, t_ms);
+            if (src.err != 0)
+            {
+                if (!any && first_err == -ENOENT)
+                    first_err = src.err;
+                continue;
+            }
+            any = true;
+
+            int32_t v = src.last_md;
+            if (policy == temp_policy::threshold && src.on_md > src.off_md && on_md > off_md)
+                v = int32_t(off_md + int64_t(v - src.off_md) * (on_md - off_md) / (src.on_md - src.off_md));
+
+            if (policy == temp_policy::mean)
+            {
+                sum += int64_t(src.weight) * v;
+                wsum += src.weight;
+            }
+            else
+                agg = std::max(agg, v);
+        }
+
+        if (!any)
+            return first_err;
+        if (policy == temp_policy::mean)
+        {
+            if (wsum <= 0)
+                return -EINVAL;
+            agg = int32_t(sum / wsum);
+        }
+        md = agg;
+        last_ok_ms = t_ms;
+        return 0;
+    }
+
+    // no source gave a usable reading for limits.stale_ms: the last value should not be trusted
+    bool stale(int64_t t_ms) const
+    {
+        int64_t since = last_ok_ms >= 0 ? last_ok_ms : first_ms;
+        return since >= 0 && t_ms - since >= limits.stale_ms;
+    }
+
+private:
+    int64_t first_ms = -1, last_ok_ms = -1;
+
+    int read_source(temp_source& src, int64_t t_ms)
+    {
+        sensor_health& h = src.health;
+        if (h.backoff_ms > 0)
+        {
+            if (t_ms < h.retry_ms)
+                return -EAGAIN;
+            src.reader->reopen();
+            h.reopens++;
+        }
+
+        int32_t v = 0;
+        int64_t t0 = monotonic_us();
+        int err = src.reader->read(v);
+        h.last_us = monotonic_us() - t0;
+        h.max_us = std::max(h.max_us, h.last_us);
+        h.reads++;
+        if (h.last_us >= limits.slow_us)
+            h.slow++;
+
+        if (err == 0)
+        {
+            if (h.same_since_ms < 0 || v != h.same_md)
+            {
+                h.same_md = v;
+                h.same_since_ms = t_ms;
+                h.stuck = false;
+            }
+            else if (limits.stuck_ms > 0 && t_ms - h.same_since_ms >= limits.stuck_ms)
+                h.stuck = true;
+            src.last_md = v;
+        }
+        else
+            h.errors++;
+
+        // an fd left on a removed file keeps returning its last contents: stuck sources are reopened too
+        if (err != 0 || h.stuck)
+        {
+            h.backoff_ms = std::min(std::max(h.backoff_ms * 2, limits.backoff_min_ms), limits.backoff_max_ms);
+            h.retry_ms = t_ms + h.backoff_ms;
+            return err != 0 ? err : -ESTALE;
+        }
+        h.backoff_ms = 0;
+        return 0;
+    }
+
+    static std::string first_line(const std::filesystem::path& p)
+    {
+        std::ifstream f(p);
+        std::string line;
+        std::getline(f, line);
+        return line;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// spike filters for high-rate sampling: fixed-size state, no allocation
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// rolling median of the last n (odd, up to max_n) samples
+class median_filter
+{
+public:
+    static constexpr int max_n = 15;
+
+    explicit median_filter(int n = 5) : n(std::min(std::max(n | 1, 1), max_n)) {}
+
+    int32_t apply(int32_t x)
+    {
+        buf[head] = x;
+        head = (head + 1) % n;
+        count = std::min(count + 1, n);
+
+        int32_t sorted[max_n];
+        std::copy(buf, buf + count, sorted);
+        std::nth_element(sorted, sorted + count / 2, sorted + count);
+        return sorted[count / 2];
+    }
+
+private:
+    int n;
+    int32_t buf[max_n];
+    int head = 0, count = 0;
+};
+
+// exponential moving average, alpha in 1/1024ths
+class ewma_filter
+{
+public:
+    explicit ewma_filter(int alpha_q10 = 256) : alpha(std::min(std::max(alpha_q10, 1), 1024)) {}
+
+    int32_t apply(int32_t x)
+    {
+        if (!init)
+        {
+            state = int64_t(x) << 10;
+            init = true;
+        }
+        else
+            state += (int64_t(x) * 1024 - state) * alpha / 1024;
+        return int32_t(state >> 10);
+    }
+
+private:
+    int alpha;
+    bool init = false;
+    int64_t state = 0;  // millidegrees << 10
+};
+
+// limits how fast the output may move, in millidegrees per second
+class slew_filter
+{
+public:
+    explicit slew_filter(int32_t max_md_per_s = 2000) : rate(max_md_per_s) {}
+
+    int32_t apply(int64_t t_ms, int32_t x)
+    {
+        if (last_t >= 0)
+        {
+            int64_t step = rate * std::max<int64_t>(t_ms - last_t, 0) / 1000;
+            x = int32_t(std::min<int64_t>(std::max<int64_t>(x, int64_t(last) - step), int64_t(last) + step));
+        }
+        last_t = t_ms;
+        last = x;
+        return x;
+    }
+
+private:
+    int32_t rate;
+    int64_t last_t = -1;
+    int32_t last = 0;
+};
+
+enum class temp_filter_kind { median, ewma, slew };
+
+// up to max_stages filters applied in order; an empty chain passes samples through
+class temp_filter_chain
+{
+public:
+    static constexpr int max_stages = 4;
+
+    median_filter median;
+    ewma_filter ewma;
+    slew_filter slew;
+
+    bool add(temp_filter_kind k)
+    {
+        if (n >= max_stages)
+            return false;
+        stages[n++] = k;
+        return true;
+    }
+
+    int size() const { return n; }
+
+    int32_t apply(int64_t t_ms, int32_t md)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            switch (stages[i])
+            {
+                case temp_filter_kind::median: md = median.apply(md); break;
+                case temp_filter_kind::ewma: md = ewma.apply(md); break;
+                case temp_filter_kind::slew: md = slew.apply(t_ms, md); break;
+            }
+        }
+        return md;
+    }
+
+private:
+    temp_filter_kind stages[max_stages];
+    int n = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// cpu load feed-forward: /proc/stat and /proc/pressure/cpu, pread() and hand-written parsers
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// the counters of the aggregate "cpu " line, in /proc/stat order
+struct cpu_times
+{
+    uint64_t v[8];  // user nice system idle iowait irq softirq steal
+
+    uint64_t idle() const { return v[3] + v[4]; }
+    uint64_t total() const
+    {
+        uint64_t t = 0;
+        for (int i = 0; i < 8; i++)
+            t += v[i];
+        return t;
+    }
+};
+
+// "cpu  4705 356 584 3699 23 23 0 0 0 0\n..." => the first 8 counters; 0, or -EINVAL
+inline int parse_proc_stat(const char* buf, size_t n, cpu_times& ct)
+{
+    if (n < 4 || buf[0] != 'c' || buf[1] != 'p' || buf[2] != 'u' || buf[3] != ' ')
+        return -EINVAL;
+    size_t i = 4;
+    for (int f = 0; f < 8; f++)
+    {
+        while (i < n && buf[i] == ' ')
+            i++;
+        if (i >= n || buf[i] < '0' || buf[i] > '9')
+        {
+            // older kernels stop after fewer fields
+            if (f < 4)
+                return -EINVAL;
+            ct.v[f] = 0;
+            continue;
+        }
+        uint64_t x = 0;
+        for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+            x = x * 10 + uint64_t(buf[i] - '0');
+        ct.v[f] = x;
+    }
+    return 0;
+}
+
+// "some avg10=12.34 avg60=..." => avg10 in hundredths of a percent; 0, or -EINVAL
+inline int parse_cpu_pressure(const char* buf, size_t n, int32_t& avg10_x100)
+{
+    const char key[] = "some avg10=";
+    const size_t klen = sizeof(key) - 1;
+    if (n < klen || memcmp(buf, key, klen) != 0)
+        return -EINVAL;
+    size_t i = klen;
+    int32_t whole = 0, frac = 0, frac_digits = 0;
+    for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+        whole = whole * 10 + (buf[i] - '0');
+    if (i < n && buf[i] == '.')
+        for (i++; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+            if (frac_digits < 2)
+            {
+                frac = frac * 10 + (buf[i] - '0');
+                frac_digits++;
+            }
+    if (i == klen)
+        return -EINVAL;
+    for (; frac_digits < 2; frac_digits++)
+        frac *= 10;
+    avg10_x100 = whole * 100 + frac;
+    return 0;
+}
+
+// cpu utilisation since the previous read, from the aggregate line of /proc/stat (first pread only,
+// it is at the start of the file) and optionally cpu pressure stall; one pread each per sample
+class cpu_load_reader
+{
+public:
+    explicit cpu_load_reader(const std::string& proc_root = "/proc", bool pressure = false)
+    {
+        stat_fd = open((proc_root + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+        psi_fd = pressure ? open((proc_root + "/pressure/cpu").c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    }
+
+    ~cpu_load_reader()
+    {
+        if (stat_fd >= 0)
+            close(stat_fd);
+        if (psi_fd >= 0)
+            close(psi_fd);
+    }
+
+    cpu_load_reader(const cpu_load_reader&) = delete;
+    cpu_load_reader& operator=(const cpu_load_reader&) = delete;
+
+    bool has_pressure() const { return psi_fd >= 0; }
+
+    // busy permille since the last call (-ENODATA on the first one), or a negative errno
+    int read_load(int32_t& permille)
+    {
+        if (stat_fd < 0)
+            return -ENOENT;
+        char buf[256];
+        ssize_t n = pread(stat_fd, buf, sizeof(buf), 0);
+        if (n < 0)
+            return -errno;
+        cpu_times ct;
+        int err = parse_proc_stat(buf, size_t(n), ct);
+        if (err != 0)
+            return err;
+
+        bool first = !have_prev;
+        uint64_t dt = ct.total() - prev.total(), di = ct.idle() - prev.idle();
+        prev = ct;
+        have_prev = true;
+        if (first || dt == 0)
+            return -ENODATA;
+        permille = int32_t((dt - std::min(di, dt)) * 1000 / dt);
+        return 0;
+    }
+
+    // some avg10 in hundredths of a percent, or a negative errno
+    int read_pressure(int32_t& avg10_x100)
+    {
+        if (psi_fd < 0)
+            return -ENOENT;
+        char buf[128];
+        ssize_t n = pread(psi_fd, buf, sizeof(buf), 0);
+        if (n < 0)
+            return -errno;
+        return parse_cpu_pressure(buf, size_t(n), avg10_x100);
+    }
+
+private:
+    int stat_fd, psi_fd;
+    cpu_times prev{};
+    bool have_prev = false;
+};
+
+#endif
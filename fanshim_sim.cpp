@@ -0,0 +1,302 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+#include "json.hpp"
+#include "fanshim_time.hpp"
+#include "fanshim_config.hpp"
+#include "fanshim_logic.hpp"
+#include "fanshim_model.hpp"
+// clang++ fanshim_sim.cpp -O2 -std=c++17 -o fanshim_sim
+
+using json = nlohmann::json;
+using namespace std;
+
+// Replays a load profile against the thermal model with the daemon's own decision logic
+// (fan_logic, built from the same fanshim.json) on a virtual clock: hours of operation in
+// milliseconds. Like the daemon, the logic sees the mean load since the previous check, not the
+// one about to come. Not simulated: sensor filters and sub-sampling, the fan kick, cpu pressure.
+
+void usage()
+{
+    cout<<"fanshim_sim [-c config] [-p profile] [-H hours] [-m model.json] [-M model.json] [-a ambient] [-i initial] [-q step] [-o from:to] [-t trace.csv]\n"
+        <<"  -c  config file (default /usr/local/etc/fanshim.json)\n"
+        <<"  -p  idle, step, daily, bursty (default daily), or a file of \"seconds load [override]\" lines:\n"
+        <<"      load 0..1 held until the next line, override 1 as if the override file existed\n"
+        <<"  -H  hours to simulate (default 24, or up to the last line of a profile file)\n"
+        <<"  -m  thermal model from fanshim_fit (default: a Pi 4 in the Fan SHIM)\n"
+        <<"  -M  thermal model mpc plans with (default: the simulated one)\n"
+        <<"  -a  ambient temperature (default 30, or the model's)\n"
+        <<"  -i  temperature at the start (default where the first load settles with the fan off)\n"
+        <<"  -q  sensor resolution in degrees (default 0: exact)\n"
+        <<"  -o  override the fan on from .. to, seconds\n"
+        <<"  -t  write every check as csv: t_ms,temp,duty,load (percent); duty as set at the check,\n"
+        <<"      load since the previous one, as the daemon records them\n";
+}
+
+struct load_step
+{
+    int64_t t_ms;
+    double load;
+    bool override_on;
+};
+
+// load held from each step's time to the next one
+vector<load_step> builtin_profile(const string& name, int64_t end_ms)
+{
+    vector<load_step> p;
+    const int64_t min_ms = 60000, hour_ms = 3600000;
+    if (name == "idle")
+        p.push_back({0, 0.05, false});
+    else if (name == "step")
+    {
+        // every hour: 10 minutes idle, 30 minutes full load, 20 minutes idle
+        for (int64_t t = 0; t < end_ms; t += hour_ms)
+        {
+            p.push_back({t, 0.05, false});
+            p.push_back({t + 10 * min_ms, 1.0, false});
+            p.push_back({t + 40 * min_ms, 0.05, false});
+        }
+    }
+    else if (name == "daily")
+    {
+        // quiet nights, busy afternoons, a build every couple of hours in the daytime
+        for (int64_t t = 0; t < end_ms; t += min_ms)
+        {
+            double h = double(t % (24 * hour_ms)) / hour_ms;
+            double load = 0.05 + 0.35 * (1 - cos(2 * M_PI * (h - 3) / 24)) / 2;
+            if (h >= 8 && h < 22 && t % (2 * hour_ms) < 15 * min_ms)
+                load = 0.95;
+            p.push_back({t, load, false});
+        }
+    }
+    else if (name == "bursty")
+    {
+        // full load bursts of 10 s .. 5 min at random, fixed seed so runs compare
+        mt19937 rng(1);
+        uniform_int_distribution<int64_t> gap(30000, 20 * min_ms), burst(10000, 5 * min_ms);
+        for (int64_t t = 0; t < end_ms;)
+        {
+            p.push_back({t, 0.08, false});
+            t += gap(rng);
+            p.push_back({t, 1.0, false});
+            t += burst(rng);
+        }
+    }
+    else
+        throw runtime_error("unknown profile " + name);
+    return p;
+}
+
+vector<load_step> read_profile(const string& path)
+{
+    ifstream f(path);
+    if (!f)
+        throw runtime_error("cannot open " + path);
+    vector<load_step> p;
+    string line;
+    while (getline(f, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        istringstream ls(line);
+        double t_s, load;
+        int ov = 0;
+        if (!(ls >> t_s >> load))
+            throw runtime_error("bad line in " + path + ": " + line);
+        ls >> ov;
+        if (load < 0 || load > 1 || (!p.empty() && t_s * 1000 < p.back().t_ms))
+            throw runtime_error("load 0..1, times increasing: " + line);
+        p.push_back({int64_t(llround(t_s * 1000)), load, ov != 0});
+    }
+    if (p.empty())
+        throw runtime_error("empty profile " + path);
+    return p;
+}
+
+string duration_str(int64_t ms)
+{
+    int64_t s = ms / 1000;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lldh %02lldm %02llds", (long long)(s / 3600), (long long)(s / 60 % 60), (long long)(s % 60));
+    return buf;
+}
+
+struct sim_stats
+{
+    int64_t checks = 0, starts = 0, stops = 0;
+    int64_t above_ms = 0, on_ms = 0, total_ms = 0;
+    double peak_md = -1e9, sum_md_ms = 0, duty_ms = 0;
+    int64_t peak_t = 0;
+
+    void print(int32_t on_md) const
+    {
+        cout<<"checks: "<<checks<<endl;
+        cout<<"temp: peak "<<fixed_str(llround(peak_md), 3)<<" at "<<duration_str(peak_t)
+            <<", mean "<<fixed_str(llround(sum_md_ms / total_ms), 3)<<endl;
+        cout<<"above on-threshold ("<<fixed_str(on_md, 3)<<"): "<<duration_str(above_ms)<<", "
+            <<fixed_str(above_ms * 1000 / total_ms, 1)<<"%"<<endl;
+        cout<<"fan: "<<starts<<" starts, "<<stops<<" stops, on "<<fixed_str(on_ms * 1000 / total_ms, 1)
+            <<"% of the time, mean duty "<<fixed_str(llround(duty_ms / total_ms), 1)<<"%"<<endl;
+    }
+};
+
+int main(int argc, char** argv)
+{
+    string conf_path = "/usr/local/etc/fanshim.json", profile = "daily", trace_path;
+    string model_path, plan_path;
+    double hours = -1, initial = NAN, quant = 0, ambient = NAN;
+    int64_t ov_from = -1, ov_to = -1;
+    thermal_model model;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string a = argv[i];
+        bool has_val = i + 1 < argc;
+        if (a == "-c" && has_val)
+            conf_path = argv[++i];
+        else if (a == "-p" && has_val)
+            profile = argv[++i];
+        else if (a == "-H" && has_val)
+            hours = stod(argv[++i]);
+        else if (a == "-m" && has_val)
+            model_path = argv[++i];
+        else if (a == "-M" && has_val)
+            plan_path = argv[++i];
+        else if (a == "-a" && has_val)
+            ambient = stod(argv[++i]) * 1000;
+        else if (a == "-i" && has_val)
+            initial = stod(argv[++i]) * 1000;
+        else if (a == "-q" && has_val)
+            quant = stod(argv[++i]) * 1000;
+        else if (a == "-o" && has_val && sscanf(argv[i + 1], "%lld:%lld", (long long*)&ov_from, (long long*)&ov_to) == 2)
+        {
+            ov_from *= 1000;
+            ov_to *= 1000;
+            i++;
+        }
+        else if (a == "-t" && has_val)
+            trace_path = argv[++i];
+        else
+        {
+            usage();
+            return a == "-h" ? 0 : 2;
+        }
+    }
+
+    try {
+        if (!model_path.empty())
+            model = read_thermal_model(model_path);
+        if (!isnan(ambient))
+            model.ambient_md = ambient;
+
+        json fs_extra = json::object();
+        map<string, int> fs_conf = get_fs_conf(fs_extra, conf_path);
+        fan_curve curve;
+        const fan_pwm_conf pwm_conf = parse_fan_pwm(fs_extra, curve);
+        fan_logic_conf conf = get_fan_logic_conf(fs_conf, fs_extra, pwm_conf.mode, curve);
+        conf.model = plan_path.empty() ? model : read_thermal_model(plan_path);
+        adaptive_schedule sched(fs_conf["delay_min"] * 1000L, fs_conf["delay_max"] * 1000L, conf.on_md, conf.off_md);
+
+        vector<load_step> steps;
+        bool builtin = profile == "idle" || profile == "step" || profile == "daily" || profile == "bursty";
+        if (hours < 0 && builtin)
+            hours = 24;
+        if (builtin)
+            steps = builtin_profile(profile, int64_t(hours * 3600000));
+        else
+            steps = read_profile(profile);
+        const int64_t end_ms = hours >= 0 ? int64_t(hours * 3600000) : steps.back().t_ms;
+        if (end_ms <= 0)
+            throw runtime_error("nothing to simulate");
+
+        ofstream trace;
+        if (!trace_path.empty())
+        {
+            trace.open(trace_path);
+            if (!trace)
+                throw runtime_error("cannot write " + trace_path);
+            trace<<"t_ms,temp,duty,load\n";
+        }
+
+        auto t0 = chrono::steady_clock::now();
+
+        fan_logic logic(conf);
+        sim_stats st;
+        size_t k = 0;
+        auto step_at = [&](int64_t t) -> const load_step& {
+            while (k + 1 < steps.size() && steps[k + 1].t_ms <= t)
+                k++;
+            return steps[k];
+        };
+
+        double md = isnan(initial) ? model.steady_md(steps[0].load, 0) : initial;
+        int duty = 0;
+        int64_t t = 0, interval_ms = conf.delay_ms;
+        // the load since the previous check, as the daemon reads it from /proc/stat; none at the first
+        double load_sum_ms = 0;
+        int64_t load_ms = 0;
+        while (t < end_ms)
+        {
+            const load_step& ls = step_at(t);
+            int32_t sensed = int32_t(llround(quant > 0 ? round(md / quant) * quant : md));
+
+            fan_inputs in{t, sensed, duty};
+            if (load_ms > 0)
+                in.load_pm = int32_t(llround(load_sum_ms / load_ms * 1000));
+            load_sum_ms = 0;
+            load_ms = 0;
+            in.override_on = ls.override_on || (t >= ov_from && t < ov_to);
+            int next = logic.decide(in);
+            if (next > 0 && duty == 0)
+                st.starts++;
+            else if (next == 0 && duty > 0)
+                st.stops++;
+            duty = next;
+            st.checks++;
+            if (trace.is_open())
+                trace<<t<<","<<fixed_str(sensed, 3)<<","<<fixed_str(duty, 1)<<","<<(in.load_pm >= 0 ? fixed_str(in.load_pm, 1) : "")<<"\n";
+
+            if (conf.adaptive)
+                interval_ms = sched.next(t, sensed);
+
+            // the plant between checks, in steps of at most a second so load changes and peaks show up
+            int64_t until = min(t + interval_ms, end_ms);
+            while (t < until)
+            {
+                int64_t dt = min<int64_t>(1000, until - t);
+                double load = step_at(t).load;
+                md = model.step(md, load, duty / 1000.0, dt / 1000.0);
+                load_sum_ms += load * dt;
+                load_ms += dt;
+                t += dt;
+                if (md > st.peak_md)
+                {
+                    st.peak_md = md;
+                    st.peak_t = t;
+                }
+                st.sum_md_ms += md * dt;
+                st.duty_ms += duty * dt;
+                st.total_ms += dt;
+                if (md > conf.on_md)
+                    st.above_ms += dt;
+                if (duty > 0)
+                    st.on_ms += dt;
+            }
+        }
+
+        double took_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        cout<<"simulated "<<duration_str(end_ms)<<" of \""<<profile<<"\" in "<<took_ms<<" ms"<<endl;
+        st.print(conf.on_md);
+    } catch (exception &e) {
+        cout<<"fanshim_sim: "<<e.what()<<endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef FANSHIM_TIME_HPP
+#define FANSHIM_TIME_HPP
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+#include <pthread.h>
+#include <time.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+// the clocks, absolute-deadline sleeps and the threads that run on them
+//////////////////////////////////////////////////////////////////////////////////////////
+
+inline int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000L + ts.tv_nsec;
+}
+
+inline int64_t monotonic_us() { return monotonic_ns() / 1000; }
+inline int64_t monotonic_ms() { return monotonic_ns() / 1000000; }
+
+// wall clock, ms since the epoch: for records read back later, never for intervals
+inline int64_t realtime_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// absolute deadline on the monotonic clock, so time spent working does not push the schedule back
+inline void sleep_until_ns(int64_t t_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = t_ns / 1000000000L;
+    ts.tv_nsec = t_ns % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+inline void sleep_until_ms(int64_t t_ms) { sleep_until_ns(t_ms * 1000000); }
+
+// std::thread(f, args...) with SIGINT/SIGTERM blocked in the new thread, so they are always
+// delivered to the main thread, whose handler stops the others
+template <typename... Args>
+std::thread start_thread_without_signals(Args&&... args)
+{
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    try {
+        std::thread th(std::forward<Args>(args)...);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return th;
+    } catch (...) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        throw;
+    }
+}
+
+#endif